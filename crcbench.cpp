@@ -0,0 +1,309 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// CrcBench: CRCの計算処理の確認と速度測定
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <wchar.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+
+#include "WStrUtil.h"
+#include "GasFs.h"
+
+// -------------------------------------------------------------
+
+static const char* const gKernelName[GasFs::CRC_KERNEL_MAX] = {
+	"table",
+	"pclmul",
+	"arm",
+};
+
+
+// =====================================================================
+// ヘルプ表示
+// =====================================================================
+
+void showHelp()
+{
+	printf("%s",
+	   "CrcBench: Check and Benchmark CRC Kernels: Version " GASFS_VERSION " GORRY.\n"
+	   "Usage:\n"
+	   "  crcbench              Compare every available CRC kernel with the byte-wise\n"
+	   "                        CRC over random offsets, lengths and seeds, then\n"
+	   "                        measure their speed.\n"
+	   "Option:\n"
+	   "  --seed [num]          First random seed (default=1).\n"
+	   "  --seeds [num]         Number of seeds to check (default=8).\n"
+	   "  --count [num]         Number of checks per seed (default=10000).\n"
+	   "  --size [bytes]        Buffer size of benchmark (K/M/G suffix, default=64M).\n"
+	   "  --loops [num]         Number of benchmark loops (default=4).\n"
+	   "  --nobench             Check only.\n"
+	   "  --help                Show this.\n"
+	);
+}
+
+// =====================================================================
+// "64M"のような数値を読む
+// =====================================================================
+
+bool
+parseSize(const std::string& str, uint64_t& value)
+{
+	char* end = nullptr;
+	uint64_t v = strtoull(str.c_str(), &end, 10);
+	if (end == str.c_str()) {
+		return false;
+	}
+	switch (toupper(*end)) {
+	  case 'G':
+		v *= 1024;
+		// FALLTHROUGH
+	  case 'M':
+		v *= 1024;
+		// FALLTHROUGH
+	  case 'K':
+		v *= 1024;
+		end++;
+		break;
+	  default:
+		break;
+	}
+	if (*end != '\0') {
+		return false;
+	}
+	value = v;
+	return true;
+}
+
+// =====================================================================
+// 1バイトずつのCRC
+// 高速化する前のGetCRC()と同じ処理で、各処理の正解として使う
+// =====================================================================
+
+uint32_t
+getCRCByte(const uint8_t* buf, size_t bufsiz, uint32_t crc)
+{
+	static uint32_t table[256] = {0};
+	const uint32_t magic = 0xedb88320;
+	crc ^= 0xffffffff;
+
+	if (table[0] == 0) {
+		for (int i=0; i<256; i++) {
+			uint32_t t = i;
+			for (int j=0; j<8; j++) {
+				int b = t & 1;
+				t >>= 1;
+				if (b) t^= magic;
+			}
+			table[i] = t;
+		}
+	}
+	while (bufsiz--) {
+		crc = table[(crc ^ *(buf++)) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+// =====================================================================
+// 各処理の確認
+// 位置・長さ・初期値を乱数で選び、1バイトずつのCRCと比べる
+// 長さは、端数処理の境目を通るよう短いものを多めにする
+// =====================================================================
+
+bool
+checkKernels(uint32_t seed, int count)
+{
+	const size_t bufSize = 1024*1024;
+	std::mt19937 rng(seed);
+	std::vector<uint8_t> buf(bufSize+64);
+	for (uint8_t& b: buf) {
+		b = (uint8_t)rng();
+	}
+
+	int errors = 0;
+	for (int i=0; i<count; i++) {
+		size_t ofs = rng() % 64;
+		size_t len;
+		switch (rng() % 4) {
+		  case 0:
+			len = rng() % 256;
+			break;
+		  case 1:
+			len = rng() % 4096;
+			break;
+		  case 2:
+			len = (rng() % 1024) * 16;
+			break;
+		  default:
+			len = rng() % bufSize;
+			break;
+		}
+		uint32_t init = (rng() % 4) ? (uint32_t)rng() : 0;
+		const uint8_t* p = buf.data()+ofs;
+		uint32_t ref = getCRCByte(p, len, init);
+
+		for (int k=0; k<GasFs::CRC_KERNEL_MAX; k++) {
+			if (!GasFs::HasCRCKernel((GasFs::CRCKernel)k)) {
+				continue;
+			}
+			uint32_t crc = GasFs::GetCRCKernel((GasFs::CRCKernel)k, p, len, init);
+			if (crc != ref) {
+				fprintf(stderr, "Failed: CRC of [%s] is different (seed=%" PRIu32 ", offset=%zu, size=%zu, init=%08" PRIx32 ", crc=%08" PRIx32 ", expected=%08" PRIx32 ").\n", gKernelName[k], seed, ofs, len, init, crc, ref);
+				errors++;
+			}
+
+			// 2つに分けて続けて計算しても同じになること
+			size_t split = (len > 0) ? (rng() % len) : 0;
+			crc = GasFs::GetCRCKernel((GasFs::CRCKernel)k, p, split, init);
+			crc = GasFs::GetCRCKernel((GasFs::CRCKernel)k, p+split, len-split, crc);
+			if (crc != ref) {
+				fprintf(stderr, "Failed: Split CRC of [%s] is different (seed=%" PRIu32 ", offset=%zu, size=%zu, split=%zu).\n", gKernelName[k], seed, ofs, len, split);
+				errors++;
+			}
+		}
+		uint32_t crc = GasFs::GetCRC((uint8_t*)p, (uint32_t)len, init);
+		if (crc != ref) {
+			fprintf(stderr, "Failed: GetCRC is different (seed=%" PRIu32 ", offset=%zu, size=%zu).\n", seed, ofs, len);
+			errors++;
+		}
+		if (errors >= 16) {
+			break;
+		}
+	}
+	return (errors == 0);
+}
+
+// =====================================================================
+// 速度測定
+// =====================================================================
+
+double
+benchKernel(int kernel, const std::vector<uint8_t>& buf, int loops)
+{
+	uint32_t crc = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i=0; i<loops; i++) {
+		if (kernel < 0) {
+			crc = getCRCByte(buf.data(), buf.size(), crc);
+		} else {
+			crc = GasFs::GetCRCKernel((GasFs::CRCKernel)kernel, buf.data(), buf.size(), crc);
+		}
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+
+	// 結果を使って、計算が省かれないようにする
+	if (crc == 0x12345678) {
+		printf(" ");
+	}
+	return (sec > 0) ? ((double)buf.size()*loops/1024/1024/sec) : 0;
+}
+
+// =====================================================================
+// メイン
+// =====================================================================
+
+int
+wmain(int argc, wchar_t** argv, wchar_t** envp)
+{
+	uint64_t seed = 1;
+	uint64_t seeds = 8;
+	uint64_t count = 10000;
+	uint64_t size = 64*1024*1024;
+	uint64_t loops = 4;
+	bool bench = true;
+
+	// ロケール設定
+#if defined(_WINDOWS)
+	const char* env = getenv("LANG");
+	if ((env == nullptr) || (env[0] == '\0')) {
+		env = ".utf8";
+	}
+	env = setlocale(LC_ALL, env);
+#endif
+
+	for (int i=1; i<argc; i++) {
+		std::wstring warg(argv[i]);
+		std::string arg = WStrUtil::wstr2str(warg);
+		if (arg == "--help") {
+			showHelp();
+			return 0;
+		}
+		if ((arg == "--seed") || (arg == "--seeds") || (arg == "--count") || (arg == "--size") || (arg == "--loops")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify %s param.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			uint64_t value = 0;
+			if (!parseSize(WStrUtil::wstr2str(argv[i+1]), value)) {
+				fprintf(stderr, "Failed: Invalid %s param.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (arg == "--seed") {
+				seed = value;
+			} else if (arg == "--seeds") {
+				seeds = value;
+			} else if (arg == "--count") {
+				count = value;
+			} else if (arg == "--size") {
+				size = value;
+			} else {
+				loops = value;
+			}
+			i++;
+			continue;
+		}
+		if (arg == "--nobench") {
+			bench = false;
+			continue;
+		}
+		fprintf(stderr, "Failed: Unknown option [%s].\n", arg.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	for (int k=0; k<GasFs::CRC_KERNEL_MAX; k++) {
+		printf("Kernel [%s]: %s\n", gKernelName[k], GasFs::HasCRCKernel((GasFs::CRCKernel)k) ? "available" : "not available");
+	}
+
+	// 確認
+	bool ok = true;
+	for (uint64_t s=seed; s<seed+seeds; s++) {
+		if (!checkKernels((uint32_t)s, (int)count)) {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		fprintf(stderr, "Failed: CRC check.\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Check OK: %" PRIu64 " seeds x %" PRIu64 " cases.\n", seeds, count);
+
+	// 速度測定
+	if (bench && (size > 0) && (loops > 0)) {
+		std::vector<uint8_t> buf((size_t)size);
+		std::mt19937 rng((uint32_t)seed);
+		for (uint8_t& b: buf) {
+			b = (uint8_t)rng();
+		}
+		printf("Bench [byte]: %.1f MB/s\n", benchKernel(-1, buf, (int)loops));
+		for (int k=0; k<GasFs::CRC_KERNEL_MAX; k++) {
+			if (GasFs::HasCRCKernel((GasFs::CRCKernel)k)) {
+				printf("Bench [%s]: %.1f MB/s\n", gKernelName[k], benchKernel(k, buf, (int)loops));
+			}
+		}
+	}
+
+	return 0;
+}
+
+// =====================================================================
+// [EOF]
@@ -13,6 +13,9 @@
 #include <wchar.h>
 #include <direct.h>
 
+#include <algorithm>
+#include <thread>
+
 #include "IniFile.h"
 #include "WStrUtil.h"
 #include "GasFs.h"
@@ -40,6 +43,11 @@ void showHelp()
 	   "  --slice [num]         Load only [num] slice.\n"
 	   "  --list [list.gfi]     Output list file.\n"
 	   "  --skipcheckcrc        Skip CRC check.\n"
+	   "  --verify              Check database, slice sizes and slice CRCs only,\n"
+	   "                        using several threads. Extract no files.\n"
+	   "  --jobs [num]          Number of threads for --verify (default: CPUs).\n"
+	   "  --verifycache [file]  Remember verified slices in [file] and skip\n"
+	   "                        checking them again while they are unchanged.\n"
 	   "  --verbose             Output verbose log.\n"
 	   "  --help                Show this.\n"
 	);
@@ -50,7 +58,7 @@ void showHelp()
 // =====================================================================
 
 bool
-exportMapList(const GasFs::Global& global, const std::string& outputFilename, const GasFs::Map& map, const std::string& extractDir)
+exportMapList(const GasFs::Global& global, const std::string& outputFilename, const GasFs::Database::View& view, const std::string& extractDir)
 {
 	FILE* fout = fopen(outputFilename.c_str(), "w");
 	if (fout == nullptr) {
@@ -65,6 +73,9 @@ exportMapList(const GasFs::Global& global, const std::string& outputFilename, co
 	fprintf(fout, "[Global]\n");
 	fprintf(fout, "Slices=%d\n", global.mSlices);
 	fprintf(fout, "MaxSliceSize=%d\n", global.mMaxSliceSize);
+	if (global.mChecksum == GasFs::CHECKSUM_XXH3) {
+		fprintf(fout, "Checksum=XXH3\n");
+	}
 	fprintf(fout, "\n");
 
 	fprintf(fout, "[Input]\n");
@@ -81,10 +92,9 @@ exportMapList(const GasFs::Global& global, const std::string& outputFilename, co
 	for (int i=1; i<=slices; i++) {
 		fprintf(fout, "[%03d]\n", i);
 		fprintf(fout, "PathList=[[[[\n");
-		for (const auto& e: map) {
-			const std::string& path = e.first;
-			const GasFs::Entry& entry = e.second;
-			if (entry.mSlice == i) {
+		for (int n=0; n<view.entries(); n++) {
+			if (view.slice(n) == i) {
+				const std::string path(view.path(n));
 				fprintf(fout, "\t%s\n", path.c_str());
 			}
 		}
@@ -150,6 +160,98 @@ createDirOfPath(const std::string& path)
 	return false;
 }
 
+// =====================================================================
+// アーカイブの確認
+// スライスを複数のスレッドに割り振って、サイズとCRCを確認する
+// スライスがスレッドより少なければ、1つのスライスを複数のスレッドで読む
+// 戻り値は確認に失敗したスライスの数
+// =====================================================================
+
+int
+verifyArchive(GasFs::Archive& archive, int jobs, int onlySlice, GasFs::VerifyCache* verifyCache)
+{
+	const GasFs::Database::View& view = archive.view();
+	const GasFs::Global& global = archive.global();
+	std::vector<int> targets;
+	for (int i=1; i<=view.slices(); i++) {
+		if (onlySlice && (i != onlySlice)) continue;
+		targets.push_back(i);
+	}
+	if (targets.empty()) {
+		return 0;
+	}
+	int workers = std::min(jobs, (int)targets.size());
+	int threadsPerSlice = std::max(1, jobs/workers);
+
+	std::mutex mutex;
+	std::atomic<int> next(0);
+	std::atomic<int> failed(0);
+	std::atomic<uint64_t> totalBytes(0);
+	auto start = std::chrono::steady_clock::now();
+	auto worker = [&]() {
+		while (!0) {
+			int t = next++;
+			if (t >= (int)targets.size()) {
+				break;
+			}
+			int i = targets[t];
+			uint64_t size = global.mSlice[i].mTotalSize;
+			auto t0 = std::chrono::steady_clock::now();
+
+			// サイズとサブヘッダはスライスを開くときに確認される
+			bool ok = archive.validateSlice(i);
+			bool cached = false;
+			uint64_t datacrc = 0;
+			if (ok && (verifyCache != nullptr)) {
+				std::lock_guard<std::mutex> lock(mutex);
+				cached = verifyCache->isVerified(archive.sliceFd(i), view.subHeader(i));
+			}
+			if (ok && !cached) {
+				ok = archive.checksumSlice(i, datacrc, threadsPerSlice, true);
+				if (ok && (datacrc != global.mSlice[i].mCRC)) {
+					fprintf(stderr, "Failed: Slice[%d] CRC error(header=%08" PRIx64 ", data=%08" PRIx64 ").\n", i, global.mSlice[i].mCRC, datacrc);
+					ok = false;
+				}
+			}
+			double sec = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!ok) {
+				failed++;
+				printf("Slice [%03d] NG\n", i);
+				continue;
+			}
+			if (cached) {
+				printf("Slice [%03d] OK %8" PRIu64 "MB (already verified)\n", i, size/1024/1024);
+				continue;
+			}
+			totalBytes += size;
+			printf("Slice [%03d] OK %8" PRIu64 "MB %8.1fMB/s\n", i, size/1024/1024, (sec > 0) ? size/1024.0/1024.0/sec : 0.0);
+			fflush(stdout);
+			if (verifyCache != nullptr) {
+				verifyCache->setVerified(archive.sliceFd(i), view.subHeader(i));
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int k=1; k<workers; k++) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (std::thread& th: threads) {
+		th.join();
+	}
+
+	// 確認済みの記録は、失敗したスライスがあっても最後にまとめて書く
+	if (verifyCache != nullptr) {
+		verifyCache->save();
+	}
+
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	printf("%d slices, %d failed, %" PRIu64 "MBytes in %.1fs (%.1fMB/s)\n", (int)targets.size(), (int)failed, (uint64_t)totalBytes/1024/1024, sec, (sec > 0) ? totalBytes/1024.0/1024.0/sec : 0.0);
+	return failed;
+}
+
 // =====================================================================
 // メイン
 // =====================================================================
@@ -159,9 +261,12 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 {
 	bool extract = false;
 	bool list = false;
+	bool verify = false;
+	int jobs = 0;
 	std::string listFilename;
 	std::string inputFilename;
 	std::string extractDir;
+	std::string verifyCacheFilename;
 	std::wstring winputFilename;
 	std::wstring wextractDir;
 	std::vector<std::string> extractFiles;
@@ -228,6 +333,34 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 			global.mSkipCheckCRC = true;
 			continue;
 		}
+		if (arg == "--verify") {
+			verify = true;
+			continue;
+		}
+		if (arg == "--jobs") {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify --jobs param.\n");
+				exit(EXIT_FAILURE);
+			}
+			jobs = atoi(WStrUtil::wstr2str(argv[i+1]).c_str());
+			if (jobs < 1) {
+				fprintf(stderr, "Failed: --jobs param > 0.\n");
+				exit(EXIT_FAILURE);
+			}
+			i++;
+			continue;
+		}
+		if (arg == "--verifycache") {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify --verifycache param.\n");
+				exit(EXIT_FAILURE);
+			}
+			std::wstring wfilename(argv[i+1]);
+			wfilename = WStrUtil::pathBackslash2Slash(wfilename);
+			verifyCacheFilename = WStrUtil::wstr2str(wfilename);
+			i++;
+			continue;
+		}
 		if (arg == "--verbose") {
 			gVerbose = true;
 			continue;
@@ -270,141 +403,292 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	}
 
 	// データベースを読み込む
-	GasFs::Map map;
-	global.mSliceFilename = inputFilename;
-	int slices = createMap(global, map);
+	// パス名の複製は作らず、データベースを直接参照する
+	// スライスファイルは、読み込むときに初めて開いて確認する
+	GasFs::Archive archive;
+	int slices = archive.open(inputFilename);
 	if (slices < 0) {
 		exit(EXIT_FAILURE);
 	}
+	const GasFs::Database::View& view = archive.view();
+	global.mSliceFilename = inputFilename;
+	global.mSlices = slices;
+	global.mMaxSliceSize = view.maxSliceSize();
+	global.mChecksum = view.checksumType();
+	global.mSlice = archive.global().mSlice;
 	if (extractSlice > slices) {
 		fprintf(stderr, "Failed: --Slice param > %d.\n", slices);
 		exit(EXIT_FAILURE);
 	}
 
+	// 対象のエントリを選ぶ
+	// エントリはパス名順に並んでいるので、フィルタと前方一致する範囲を二分探索で求める
+	std::vector<std::vector<int>> sliceEntries(slices+1);
+	if (extractFiles.empty()) {
+		for (int n=0; n<view.entries(); n++) {
+			sliceEntries[view.slice(n)].push_back(n);
+		}
+	} else {
+		std::vector<int> found;
+		for (int j=0; j<(int)extractFiles.size(); j++) {
+			const std::string& f = extractFiles[j];
+			for (int n=view.lowerBound(f); n<view.entries(); n++) {
+				if (view.path(n).compare(0, f.size(), f) != 0) {
+					break;
+				}
+				found.push_back(n);
+			}
+		}
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		for (int n: found) {
+			sliceEntries[view.slice(n)].push_back(n);
+		}
+	}
+
+	// 確認済みスライスのキャッシュを読む
+	GasFs::VerifyCache verifyCache;
+	if (!verifyCacheFilename.empty()) {
+		verifyCache.load(verifyCacheFilename);
+	}
+
+	// 確認のみを行う
+	// データベースのCRCはarchive.open()で確認済み
+	if (verify) {
+		if (jobs < 1) {
+			jobs = std::max(1, (int)std::thread::hardware_concurrency());
+		}
+		int failed = verifyArchive(archive, jobs, extractSlice, verifyCacheFilename.empty() ? nullptr : &verifyCache);
+		if (failed) {
+			fprintf(stderr, "Failed: Verify [%s_000.gfs]: %d slices have errors.\n", inputFilename.c_str(), failed);
+			exit(EXIT_FAILURE);
+		}
+		printf("Verified [%s_000.gfs] with %d slices, %d files archived.\n", inputFilename.c_str(), slices, view.entries());
+		return 0;
+	}
+
+	// 確認済みの記録は最後にまとめて書く
+	// 途中で失敗して終了するときも、それまでに確認できたスライスは書いておく
+	auto failExit = [&]() {
+		verifyCache.save();
+		exit(EXIT_FAILURE);
+	};
+
 	// データベースを読んでいく
 	for (int i=1; i<=slices; i++) {
 		if (extractSlice) {
 			if (i != extractSlice) continue;
 		}
+		// フィルタ指定時は、対象のファイルがないスライスに触らない
+		if (!extractFiles.empty() && sliceEntries[i].empty()) {
+			continue;
+		}
 		printf("Slice [%03d]\n", i);
 
-		// 読み込み元スライスを開く
+		// 読み込み元スライスを開き、サブヘッダとサイズを確認
 		char filename[_MAX_PATH];
 		sprintf(filename, "%s_%03d.gfs", inputFilename.c_str(), i);
-		FILE* fin = fopen(filename, "rb");
-		if (fin == nullptr) {
-			fprintf(stderr, "Failed: Cannot open file [%s]\n", filename);
-			exit(EXIT_FAILURE);
+		if (!archive.validateSlice(i)) {
+			failExit();
+		}
+
+		// 前回までに確認済みで、スライスファイルが変わっていなければ確認を省く
+		bool verified = false;
+		if (!verifyCacheFilename.empty() && !global.mSkipCheckCRC) {
+			verified = verifyCache.isVerified(archive.sliceFd(i), view.subHeader(i));
+			if (verified && gVerbose) {
+				printf("Skip CRC check: Slice[%d] already verified.\n", i);
+			}
 		}
 
 		// スライスのCRCチェック
-		if (!global.mSkipCheckCRC) {
-			fseek(fin, sizeof(GasFs::Database::SubHeader), SEEK_SET);
-			uint8_t buf[1024*64];
-			uint32_t datacrc = 0;
-			while (!0) {
-				uint32_t readsize = sizeof(buf);
-				readsize = fread(buf, 1, readsize, fin);
-				if (readsize == 0) break;
-				datacrc = GasFs::GetCRC(buf, readsize, datacrc);
+		// ファイルごとのCRCがあれば、抽出時は抽出するファイルだけを確認する
+		// 抽出時にスライスのCRCが必要なら、抽出しながらスライス全体を先頭から読んで求める
+		const bool checkFileCRC = extract && view.hasFileCRC() && !global.mSkipCheckCRC && !verified;
+		const bool streamSliceCRC = extract && !global.mSkipCheckCRC && !checkFileCRC && !verified;
+		if (!global.mSkipCheckCRC && !checkFileCRC && !streamSliceCRC && !verified) {
+			uint64_t datacrc = 0;
+			if (!archive.checksumSlice(i, datacrc)) {
+				failExit();
 			}
-			uint32_t crc = global.mSlice[i].mCRC;
+			uint64_t crc = global.mSlice[i].mCRC;
 			if (crc != datacrc) {
-				fprintf(stderr, "Failed: Slice[%d] CRC error(header=%08x, data=%08x) [%s].\n", i, crc, datacrc, filename);
-				exit(EXIT_FAILURE);
+				fprintf(stderr, "Failed: Slice[%d] CRC error(header=%08" PRIx64 ", data=%08" PRIx64 ") [%s].\n", i, crc, datacrc, filename);
+				failExit();
 			}
+			verified = true;
 		}
 
-		int files = 0;
-		int64_t totalSize = 0;
-		for (const auto& e: map) {
-			const std::string& path = e.first;
-			const GasFs::Entry& entry = e.second;
-			if (entry.mSlice == i) {
-				if (!extractFiles.empty()) {
-					bool found = false;
-					for (int j=0; j<(int)extractFiles.size(); j++) {
-						const std::string& f = extractFiles[j];
-						if (!memcmp(f.c_str(), path.c_str(), f.size())) {
-							found = true;
-						}
-					}
-					if (!found) continue;
+		// 抽出したファイルは一時ファイル名で書き、確認が済んだらリネームする
+		// 確認に失敗したら、このスライスで書いた一時ファイルをすべて消す
+		std::vector<std::pair<std::string, std::string>> tempFiles;
+		FILE* fout = nullptr;
+		auto rollback = [&]() {
+			if (fout != nullptr) {
+				fclose(fout);
+				fout = nullptr;
+			}
+			for (const auto& t: tempFiles) {
+				remove(t.first.c_str());
+			}
+			failExit();
+		};
+
+		// スライスの先頭から順に読み、読んだ範囲のCRCを積み上げる
+		// 抽出しないファイルの間隙もCRCのために読む
+		// 読み込み・CRC計算・書き込みは重ねて行う
+		GasFs::CopyPipeline pipeline;
+		uint64_t slicePos = 0;
+		GasFs::Checksum slicecrc(global.mChecksum);
+		auto readRange = [&](uint64_t offset, uint64_t size, const std::string& path, GasFs::Checksum* filecrc) {
+			uint64_t readPos = offset;
+			uint64_t sumPos = offset;
+			auto reader = [&](uint8_t* buf, size_t len) -> int64_t {
+				int64_t readsize = archive.readSlice(i, readPos, len, buf);
+				if (readsize <= 0) {
+					fprintf(stderr, "Failed: Cannot read Slice[%d] [%s].\n", i, filename);
+					return -1;
 				}
-				if (gVerbose) {
-					printf("  %10" PRIu64 " %s\n", entry.mSize, path.c_str());
+				readPos += readsize;
+				return readsize;
+			};
+			auto checksum = [&](const uint8_t* buf, size_t len) {
+				if (streamSliceCRC && (sumPos <= slicePos) && (sumPos+len > slicePos)) {
+					uint64_t skip = slicePos-sumPos;
+					slicecrc.update(buf+skip, (size_t)(len-skip));
+					slicePos = sumPos+len;
 				}
-				if (extract) {
-					// 書き込み先を開く
-					const std::wstring wpath = WStrUtil::str2wstr(path);
-					const std::wstring wnewpath = WStrUtil::pathAddPath(wextractDir, wpath);
-					const std::string newpath = WStrUtil::wstr2str(wnewpath);
-					FILE* fout = fopen(newpath.c_str(), "wb");
-					if (fout == nullptr) {
-						// 書き込み先が開けない場合、
-						// 書き込み先のディレクトリを作ってみる
-						bool b = createDirOfPath(newpath);
-						if (!b) {
-							exit(EXIT_FAILURE);
-						}
-						fout = fopen(newpath.c_str(), "wb");
-						if (fout == nullptr) {
-							fprintf(stderr, "Failed: Cannot create file [%s]\n", newpath.c_str());
-							exit(EXIT_FAILURE);
-						}
+				if (filecrc != nullptr) {
+					filecrc->update(buf, len);
+				}
+				sumPos += len;
+				return true;
+			};
+			auto writer = [&](const uint8_t* buf, size_t len) {
+				if (fout != nullptr) {
+					size_t wrotesize = fwrite(buf, 1, len, fout);
+					if (wrotesize != len) {
+						fprintf(stderr, "Failed: Cannot write [%s].\n", path.c_str());
+						return false;
 					}
+				}
+				return true;
+			};
+			if (pipeline.run(size, reader, checksum, writer) != (int64_t)size) {
+				rollback();
+			}
+		};
 
-					// 読み込み元スライスをシーク
-					fpos_t pos = entry.mOffset + sizeof(GasFs::Database::SubHeader);
-					fsetpos(fin, &pos);
-
-					// bufsizeずつスライスから書き写す
-					uint64_t rest = entry.mSize;
-					const int bufsize = 1024*1024*16;
-					uint8_t* buf = new uint8_t[bufsize];
-					while (rest > 0) {
-						uint64_t size = bufsize;
-						if (size > rest) {
-							size = rest;
-						}
-						size_t readsize = fread(buf, 1, (size_t)size, fin);
-						if (readsize == 0) {
-							break;
-						}
-						size_t wrotesize = fwrite(buf, 1, readsize, fout);
-						if (wrotesize != readsize) {
-							fprintf(stderr, "Failed: Cannot write [%s].\n", newpath.c_str());
-							exit(EXIT_FAILURE);
-						}
-						rest -= readsize;
-					}
-					delete[] buf;
+		// 書き出しはスライス内のオフセット順にする
+		std::vector<int> order(sliceEntries[i]);
+		if (extract) {
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return view.offset(a) < view.offset(b); });
+		}
 
-					// 書き写し終了
-					int ret = fclose(fout);
-					if (ret) {
-						fprintf(stderr, "Failed: Cannot write [%s].\n", newpath.c_str());
-						exit(EXIT_FAILURE);
+		int files = 0;
+		int64_t totalSize = 0;
+		const std::string tempSuffix = ".tmp" + std::to_string(GasFs::my_getpid());
+		for (int n: order) {
+			const std::string path(view.path(n));
+			const GasFs::Entry entry = view.entry(n);
+			if (gVerbose) {
+				printf("  %10" PRIu64 " %s\n", entry.mSize, path.c_str());
+			}
+			if (extract) {
+				// 直前のファイルとの間隙を読む
+				if (streamSliceCRC && (entry.mOffset > slicePos)) {
+					readRange(slicePos, entry.mOffset-slicePos, path, nullptr);
+				}
+
+				// 書き込み先を開く
+				const std::wstring wpath = WStrUtil::str2wstr(path);
+				const std::wstring wnewpath = WStrUtil::pathAddPath(wextractDir, wpath);
+				const std::string newpath = WStrUtil::wstr2str(wnewpath);
+				const std::string temppath = newpath + tempSuffix;
+				fout = fopen(temppath.c_str(), "wb");
+				if (fout == nullptr) {
+					// 書き込み先が開けない場合、
+					// 書き込み先のディレクトリを作ってみる
+					bool b = createDirOfPath(newpath);
+					if (!b) {
+						rollback();
 					}
+					fout = fopen(temppath.c_str(), "wb");
+					if (fout == nullptr) {
+						fprintf(stderr, "Failed: Cannot create file [%s]\n", temppath.c_str());
+						rollback();
+					}
+				}
+				tempFiles.emplace_back(temppath, newpath);
+
+				// スライスから書き写す
+				GasFs::Checksum filecrc(global.mChecksum);
+				readRange(entry.mOffset, entry.mSize, newpath, checkFileCRC ? &filecrc : nullptr);
+
+				// 書き写し終了
+				int ret = fclose(fout);
+				fout = nullptr;
+				if (ret) {
+					fprintf(stderr, "Failed: Cannot write [%s].\n", newpath.c_str());
+					rollback();
 				}
-				files++;
-				totalSize += entry.mSize;
+
+				// ファイルのCRCチェック
+				// XXH3の場合、ファイルのチェックサムは下位32bitを記録している
+				const uint32_t datacrc = (uint32_t)filecrc.digest();
+				if (checkFileCRC && (datacrc != entry.mCRC)) {
+					fprintf(stderr, "Failed: File CRC error(header=%08x, data=%08x) [%s].\n", entry.mCRC, datacrc, path.c_str());
+					rollback();
+				}
+			}
+			files++;
+			totalSize += entry.mSize;
+		}
+
+		// 最後のファイルの後ろを読んで、スライスのCRCを確認する
+		if (streamSliceCRC) {
+			const uint64_t sliceSize = global.mSlice[i].mTotalSize;
+			if (sliceSize > slicePos) {
+				readRange(slicePos, sliceSize-slicePos, filename, nullptr);
+			}
+			uint64_t crc = global.mSlice[i].mCRC;
+			uint64_t datacrc = slicecrc.digest();
+			if (crc != datacrc) {
+				fprintf(stderr, "Failed: Slice[%d] CRC error(header=%08" PRIx64 ", data=%08" PRIx64 ") [%s].\n", i, crc, datacrc, filename);
+				rollback();
 			}
+			verified = true;
 		}
 
-		fclose(fin);
+		// 確認が済んだので、一時ファイルを本来の名前にする
+		for (const auto& t: tempFiles) {
+			if (GasFs::my_rename(t.first.c_str(), t.second.c_str())) {
+				fprintf(stderr, "Failed: Cannot rename [%s] to [%s].\n", t.first.c_str(), t.second.c_str());
+				rollback();
+			}
+		}
 
 		if (files) {
 			printf("%d files, %" PRIi64 "MBytes\n", files, totalSize/1024/1024);
 		}
+
+		// スライスの全ファイルのCRCを確認できたら、スライス全体を確認したのと同じ
+		// XXH3ではファイルごとに下位32bitしか確かめていないので、スライス全体の確認とはしない
+		if (checkFileCRC && (global.mChecksum == GasFs::CHECKSUM_CRC32) && (files == global.mSlice[i].mFiles)) {
+			verified = true;
+		}
+		if (verified && !verifyCacheFilename.empty()) {
+			verifyCache.setVerified(archive.sliceFd(i), view.subHeader(i));
+		}
 	}
+	verifyCache.save();
 
 	// スライスリストをエクスポート
 	if (list) {
-		exportMapList(global, listFilename, map, extractDir);
+		exportMapList(global, listFilename, view, extractDir);
 	}
 
-	printf("Read [%s.000] with %d slices, %zu files archived.\n", inputFilename.c_str(), slices, map.size());
+	printf("Read [%s.000] with %d slices, %d files archived.\n", inputFilename.c_str(), slices, view.entries());
 
 	return 0;
 }
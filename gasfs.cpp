@@ -10,6 +10,9 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <time.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "GasFs.h"
 
@@ -18,162 +21,546 @@ namespace GasFs {
 // -------------------------------------------------------------
 
 // =====================================================================
-// スライスマップの作成
+// リトルエンディアン値の取り出し
 // =====================================================================
 
-int
-createMap(GasFs::Global& global, GasFs::Map& map)
+static inline uint64_t
+getLE(const uint8_t* p, int bytes)
 {
-	// データベースファイルを開く
-	std::string filename = global.mSliceFilename+"_000.gfs";
-	MY_FILE fin = my_fopen(filename.c_str(), "rb");
-	if (fin == nullptr) {
-		my_printerr("Failed: Cannot open [%s].\n", filename.c_str());
-		return -1;
+	uint64_t v = 0;
+	for (int i=bytes-1; i>=0; i--) {
+		v = (v<<8) | p[i];
 	}
-	my_fseek(fin, 0, SEEK_END);
-	my_fpos_t pos;
-	my_fgetpos(fin, &pos);
-	size_t filesize = (size_t)pos;
-	my_fseek(fin, 0, SEEK_SET);
-	uint8_t* buf = new uint8_t[filesize];
-	if (buf == nullptr) {
-		my_printerr("Failed: Memory exhaused at reading [%s].\n", filename.c_str());
-		my_fclose(fin);
-		return -1;
+	return v;
+}
+
+// =====================================================================
+// パス名のハッシュ
+// =====================================================================
+
+static inline uint64_t
+mixHash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t
+GetPathHash(const char* path, size_t len)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i=0; i<len; i++) {
+		h ^= (uint8_t)path[i];
+		h *= 0x00000100000001b3ULL;
 	}
-	size_t readsize = my_fread(buf, 1, filesize, fin);
-	my_fclose(fin);
-	if (readsize != filesize) {
-		my_printerr("Failed: Cannot read [%s].\n", filename.c_str());
+	return mixHash(h);
+}
+
+static inline uint32_t
+GetHashSlot(uint64_t hash, uint32_t disp, uint32_t slots)
+{
+	return (uint32_t)(mixHash(hash + disp*0x9e3779b97f4a7c15ULL) % slots);
+}
+
+// =====================================================================
+// ハッシュインデックスの作成
+// hash and displace法による最小完全ハッシュ
+// 各バケットに、そのバケット内の全パスが空きスロットへ収まる変位を記録する
+// =====================================================================
+
+bool
+MakeHashIndex(const std::vector<uint64_t>& hashes, std::vector<uint8_t>& section)
+{
+	uint32_t entries = (uint32_t)hashes.size();
+	if (entries == 0) {
+		return false;
+	}
+	uint32_t buckets = (entries+3)/4;
+
+	// 同じハッシュ値が2つあると、どの変位でも同じスロットに落ちて配置できない
+	{
+		std::vector<uint64_t> sorted(hashes);
+		std::sort(sorted.begin(), sorted.end());
+		if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+			return false;
+		}
+	}
+
+	// パスをバケットに振り分け、大きいバケットから配置する
+	std::vector<std::vector<uint32_t>> bucketList(buckets);
+	for (uint32_t i=0; i<entries; i++) {
+		bucketList[(uint32_t)((hashes[i]>>32) % buckets)].push_back(i);
+	}
+	std::vector<uint32_t> order(buckets);
+	for (uint32_t b=0; b<buckets; b++) {
+		order[b] = b;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return bucketList[a].size() > bucketList[b].size();
+	});
+
+	std::vector<uint32_t> disp(buckets, 0);
+	std::vector<uint32_t> slotEntry(entries, 0);
+	std::vector<uint8_t> used(entries, 0);
+	std::vector<uint32_t> slots;
+	// 変位の探索は打ち切る。見つからなければインデックスを作らず、読む側は二分探索を使う
+	// 最後の1つだけのバケットでも空きは1スロット以上あるので、スロット数の16倍試せばまず見つかる
+	const uint32_t maxDisp = (uint32_t)std::min<uint64_t>((uint64_t)entries*16+0x10000, 0x40000000);
+	uint64_t budget = (uint64_t)std::max<uint32_t>(entries, 0x10000)*256;
+	for (uint32_t b: order) {
+		const std::vector<uint32_t>& list = bucketList[b];
+		if (list.empty()) {
+			break;
+		}
+		uint32_t d;
+		for (d=1; d<maxDisp; d++) {
+			slots.clear();
+			bool ok = true;
+			for (uint32_t i: list) {
+				uint32_t slot = GetHashSlot(hashes[i], d, entries);
+				if (used[slot] || (std::find(slots.begin(), slots.end(), slot) != slots.end())) {
+					ok = false;
+					break;
+				}
+				slots.push_back(slot);
+			}
+			if (ok) {
+				break;
+			}
+			if (--budget == 0) {
+				return false;
+			}
+		}
+		if (d >= maxDisp) {
+			return false;
+		}
+		disp[b] = d;
+		for (size_t i=0; i<list.size(); i++) {
+			used[slots[i]] = 1;
+			slotEntry[slots[i]] = list[i];
+		}
+	}
+
+	// セクションの中身を作る
+	section.resize(4+(size_t)buckets*4+(size_t)entries*3);
+	uint8_t* p = section.data();
+	for (int i=0; i<4; i++) {
+		*(p++) = (buckets>>(i*8))&0xff;
+	}
+	for (uint32_t b=0; b<buckets; b++) {
+		for (int i=0; i<4; i++) {
+			*(p++) = (disp[b]>>(i*8))&0xff;
+		}
+	}
+	for (uint32_t slot=0; slot<entries; slot++) {
+		for (int i=0; i<3; i++) {
+			*(p++) = (slotEntry[slot]>>(i*8))&0xff;
+		}
+	}
+	return true;
+}
+
+// =====================================================================
+// データベースビュー
+// =====================================================================
+
+namespace Database {
+
+View::View()
+ : mMap(nullptr)
+ , mData(nullptr)
+ , mDataSize(0)
+ , mSubHeader(nullptr)
+ , mEntry(nullptr)
+ , mPath(nullptr)
+ , mPathSize(0)
+ , mHashIndex(nullptr)
+ , mHashBuckets(0)
+ , mFileCRC(nullptr)
+ , mChunkCRC(nullptr)
+ , mChunkSize(0)
+ , mSlices(0)
+ , mEntries(0)
+ , mMaxSliceSize(0)
+ , mChecksumType(CHECKSUM_CRC32)
+{
+}
+
+View::~View()
+{
+	close();
+}
+
+int
+View::open(const std::string& filename, bool checkCRC)
+{
+	close();
+
+	// データベースファイルをマップする
+	size_t filesize = 0;
+	MY_MAP map = nullptr;
+	const uint8_t* data = my_mmap(filename.c_str(), &filesize, &map);
+	if (data == nullptr) {
+		my_printerr("Failed: Cannot open [%s].\n", filename.c_str());
 		return -1;
 	}
-	uint8_t* p = buf;
+	mMap = map;
+	mData = data;
+	mDataSize = filesize;
 
 	// データベースファイルのチェック
-	GasFs::Database::Header* header = (GasFs::Database::Header*)p;
-	p += sizeof(GasFs::Database::Header);
+	if (filesize < sizeof(Header)) {
+		my_printerr("Failed: Not GasFs file [%s].\n", filename.c_str());
+		close();
+		return -1;
+	}
+	const Header* header = (const Header*)data;
+	const uint8_t* p = data + sizeof(Header);
 	if (memcmp(&(header->mMark[0]), GASFS_MARK, 4)) {
 		my_printerr("Failed: Not GasFs file [%s].\n", filename.c_str());
+		close();
 		return -1;
 	}
 	int slices = header->mSlices[0];
-	int entries = (header->mEntries[0]<<0) | (header->mEntries[1]<<8) |(header->mEntries[2]<<16);
-	uint32_t totalSize = (header->mTotalSize[0]<<0) | (header->mTotalSize[1]<<8) | (header->mTotalSize[2]<<16) | (header->mTotalSize[3]<<24);
-	int maxSliceSize = (header->mMaxSliceSize[0]<<0) | (header->mMaxSliceSize[1]<<8) | (header->mMaxSliceSize[2]<<16) | (header->mMaxSliceSize[3]<<24);
-	uint32_t crc = (header->mCRC[0]<<0) | (header->mCRC[1]<<8) | (header->mCRC[2]<<16) | (header->mCRC[3]<<24);
-	uint32_t datasize = readsize-sizeof(GasFs::Database::Header);
+	int entries = (int)getLE(header->mEntries, 3);
+	uint32_t totalSize = (uint32_t)getLE(header->mTotalSize, 4);
+	int maxSliceSize = (int)getLE(header->mMaxSliceSize, 4);
+	uint32_t crc = (uint32_t)getLE(header->mCRC, 4);
+	uint32_t datasize = (uint32_t)(filesize-sizeof(Header));
 	if (totalSize != datasize) {
 		my_printerr("Failed: Database size error(header=%08x, data=%08x) [%s].\n", totalSize, datasize, filename.c_str());
+		close();
 		return -1;
 	}
-	{
-		uint32_t datacrc = GasFs::GetCRC(p, datasize, 0);
+	size_t tableSize = sizeof(SubHeader)*slices + sizeof(Entry)*entries;
+	if (tableSize > datasize) {
+		my_printerr("Failed: Database size error(header=%08x, data=%08x) [%s].\n", (uint32_t)tableSize, datasize, filename.c_str());
+		close();
+		return -1;
+	}
+	// XXH3の場合、ヘッダには下位32bitを記録している
+	ChecksumType checksumType = (header->mFlags[0] & GASFS_FLAG_XXH3) ? CHECKSUM_XXH3 : CHECKSUM_CRC32;
+	if (checkCRC) {
+		uint32_t datacrc = (uint32_t)GasFs::GetChecksum(checksumType, p, datasize);
 		if (crc != datacrc) {
 			my_printerr("Failed: Database CRC error(header=%08x, data=%08x) [%s].\n", crc, datacrc, filename.c_str());
+			close();
 			return -1;
 		}
 	}
-	global.mSlice.resize(slices+1);
 
-	// スライスファイルのチェック
-	GasFs::Database::SubHeader* subheader = (GasFs::Database::SubHeader*)p;
-	p += sizeof(GasFs::Database::SubHeader)*slices;
-	for (int i=1; i<=slices; i++) {
-		char str[16];
-		sprintf(str, "_%03d.gfs", i);
-		filename = global.mSliceFilename + std::string(str);
-		fin = my_fopen(filename.c_str(), "rb");
-		if (fin == nullptr) {
-			my_printerr("Failed: Cannot open [%s].\n", filename.c_str());
+	// 各テーブルの位置を決める
+	mSubHeader = (const SubHeader*)p;
+	p += sizeof(SubHeader)*slices;
+	mEntry = (const Entry*)p;
+	p += sizeof(Entry)*entries;
+	mPath = (const char*)p;
+	mPathSize = (size_t)(data+filesize-p);
+
+	// 拡張セクションを探す
+	// 旧版のmkgasfsはフラグを0で書くので、フラグがなければパス名リストが末尾まで続く
+	if (header->mFlags[0] & GASFS_FLAG_EXTENSION) {
+		size_t extofs = (size_t)getLE(header->mExtOfs, 4);
+		if ((extofs < tableSize) || (extofs > datasize)) {
+			my_printerr("Failed: Database extension offset error(%08zx) [%s].\n", extofs, filename.c_str());
+			close();
 			return -1;
 		}
-		GasFs::Database::SubHeader b = {0};
-		readsize = my_fread(&b, 1, sizeof(b), fin);
-
-		// スライスファイルのサイズを得ておく
-		my_fseek(fin, 0, SEEK_END);
-		my_fpos_t pos;
-		my_fgetpos(fin, &pos);
-		uint64_t datasize = pos - sizeof(GasFs::Database::SubHeader);
-
-		my_fclose(fin);
-		if (readsize != sizeof(b)) {
-			my_printerr("Failed: Cannot read [%s].\n", filename.c_str());
-			return -1;
+		const uint8_t* ext = data + sizeof(Header) + extofs;
+		const uint8_t* end = data + filesize;
+		mPathSize = (size_t)(ext-p);
+		while (ext+sizeof(ExtSection) <= end) {
+			const ExtSection* sec = (const ExtSection*)ext;
+			size_t secsize = (size_t)getLE(sec->mSize, 4);
+			ext += sizeof(ExtSection);
+			if (secsize > (size_t)(end-ext)) {
+				my_printerr("Failed: Database extension size error(%08zx) [%s].\n", secsize, filename.c_str());
+				close();
+				return -1;
+			}
+			if (!memcmp(&(sec->mTag[0]), GASFS_EXT_HASHINDEX, 4)) {
+				uint32_t buckets = (secsize >= 4) ? (uint32_t)getLE(ext, 4) : 0;
+				if ((buckets > 0) && (secsize == 4+(size_t)buckets*4+(size_t)entries*3)) {
+					mHashIndex = ext;
+					mHashBuckets = buckets;
+				}
+			}
+			if (!memcmp(&(sec->mTag[0]), GASFS_EXT_FILECRC, 4)) {
+				if (secsize == (size_t)entries*4) {
+					mFileCRC = ext;
+				}
+			}
+			if (!memcmp(&(sec->mTag[0]), GASFS_EXT_CHUNKCRC, 4)) {
+				// チャンク数はサブヘッダのスライスサイズから決まる
+				uint32_t chunkSize = (secsize >= 4) ? (uint32_t)getLE(ext, 4) : 0;
+				if (chunkSize > 0) {
+					std::vector<uint64_t> base(slices+2, 0);
+					for (int i=1; i<=slices; i++) {
+						uint64_t sliceSize = getLE(mSubHeader[i-1].mTotalSize, 8);
+						base[i+1] = base[i] + (sliceSize+chunkSize-1)/chunkSize;
+					}
+					if (secsize == 4+base[slices+1]*4) {
+						mChunkCRC = ext+4;
+						mChunkSize = chunkSize;
+						mChunkBase.swap(base);
+					}
+				}
+			}
+			// 知らないセクションは読み飛ばす
+			ext += secsize;
 		}
-		if (memcmp(&b, &subheader[i-1], sizeof(b))) {
-			my_printerr("Failed: Slice[%d] SubHeader are different [%s].\n", i, filename.c_str());
-			return -1;
+	}
+
+	mSlices = slices;
+	mEntries = entries;
+	mMaxSliceSize = maxSliceSize;
+	mChecksumType = checksumType;
+
+	return slices;
+}
+
+void
+View::close()
+{
+	if (mData != nullptr) {
+		my_munmap(mMap, mData, mDataSize);
+	}
+	mMap = nullptr;
+	mData = nullptr;
+	mDataSize = 0;
+	mSubHeader = nullptr;
+	mEntry = nullptr;
+	mPath = nullptr;
+	mPathSize = 0;
+	mHashIndex = nullptr;
+	mHashBuckets = 0;
+	mFileCRC = nullptr;
+	mChunkCRC = nullptr;
+	mChunkSize = 0;
+	mChunkBase.clear();
+	mSlices = 0;
+	mEntries = 0;
+	mMaxSliceSize = 0;
+	mChecksumType = CHECKSUM_CRC32;
+}
+
+std::string_view
+View::path(int n) const
+{
+	size_t pathofs = (size_t)getLE(mEntry[n].mPathOfs, 3);
+	if (pathofs >= mPathSize) {
+		return std::string_view();
+	}
+	const char* p = mPath + pathofs;
+	return std::string_view(p, strnlen(p, mPathSize-pathofs));
+}
+
+uint64_t
+View::offset(int n) const
+{
+	return getLE(mEntry[n].mOffset, 6);
+}
+
+uint64_t
+View::size(int n) const
+{
+	return getLE(mEntry[n].mSize, 6);
+}
+
+uint32_t
+View::fileCRC(int n) const
+{
+	if (mFileCRC == nullptr) {
+		return 0;
+	}
+	return (uint32_t)getLE(mFileCRC+(size_t)n*4, 4);
+}
+
+uint64_t
+View::chunks(int slice) const
+{
+	if (mChunkCRC == nullptr) {
+		return 0;
+	}
+	return mChunkBase[slice+1]-mChunkBase[slice];
+}
+
+uint32_t
+View::chunkCRC(int slice, uint64_t chunk) const
+{
+	if (mChunkCRC == nullptr) {
+		return 0;
+	}
+	return (uint32_t)getLE(mChunkCRC+(size_t)(mChunkBase[slice]+chunk)*4, 4);
+}
+
+GasFs::Entry
+View::entry(int n) const
+{
+	GasFs::Entry entry = {0};
+	entry.mSlice = slice(n);
+	entry.mOffset = offset(n);
+	entry.mSize = size(n);
+	entry.mCRC = fileCRC(n);
+	return entry;
+}
+
+int
+View::find(std::string_view path) const
+{
+	if (mHashIndex != nullptr) {
+		// ハッシュインデックスから候補を1つ決めて照合する
+		uint64_t hash = GasFs::GetPathHash(path.data(), path.size());
+		uint32_t bucket = (uint32_t)((hash>>32) % mHashBuckets);
+		uint32_t disp = (uint32_t)getLE(mHashIndex+4+bucket*4, 4);
+		uint32_t slot = GasFs::GetHashSlot(hash, disp, mEntries);
+		int n = (int)getLE(mHashIndex+4+(size_t)mHashBuckets*4+(size_t)slot*3, 3);
+		if ((n < mEntries) && (this->path(n) == path)) {
+			return n;
 		}
-		global.mSlice[i].mFiles = (b.mFiles[0]<<0) | (b.mFiles[1]<<8) | (b.mFiles[0]<<16);
-		uint32_t totalSizeL = (b.mTotalSize[0] << 0) | (b.mTotalSize[1] << 8) | (b.mTotalSize[2] << 16) | (b.mTotalSize[3] << 24);
-		uint32_t totalSizeH = (b.mTotalSize[4] << 0) | (b.mTotalSize[5] << 8) | (b.mTotalSize[6] << 16) | (b.mTotalSize[7] << 24);
-		uint64_t totalSize = (uint64_t)totalSizeL | (uint64_t)totalSizeH;
-		global.mSlice[i].mTotalSize = totalSize;
-		global.mSlice[i].mCRC = (b.mCRC[0]<<0) | (b.mCRC[1]<<8) | (b.mCRC[2]<<16) | (b.mCRC[3]<<24);
-		struct tm lt;
-		lt.tm_year = ((b.mDate[0]>>4)*1000)+((b.mDate[0]&0x0f)*100)+((b.mDate[1]>>4)*10)+((b.mDate[1]&0x0f)*1) - 1900;
-		lt.tm_mon = ((b.mDate[2]>>4)*10)+((b.mDate[2]&0x0f)*1) - 1;
-		lt.tm_mday = ((b.mDate[3]>>4)*10)+((b.mDate[3]&0x0f)*1);
-		lt.tm_hour = ((b.mDate[4]>>4)*10)+((b.mDate[4]&0x0f)*1);
-		lt.tm_min = ((b.mDate[5]>>4)*10)+((b.mDate[5]&0x0f)*1);
-		lt.tm_sec = ((b.mDate[6]>>4)*10)+((b.mDate[6]&0x0f)*1);
-		global.mSlice[i].mLastModifiedTime = (uint64_t)mktime(&lt);
-
-		if (totalSize != datasize) {
-			my_printerr("Failed: Database size error(header=%" PRIx64 ", data=%" PRIx64 ") [%s].\n", totalSize, datasize, filename.c_str());
-			return -1;
+		return -1;
+	}
+
+	// エントリはパス名順に並んでいるので二分探索する
+	int n = lowerBound(path);
+	if ((n < mEntries) && (this->path(n) == path)) {
+		return n;
+	}
+	return -1;
+}
+
+int
+View::lowerBound(std::string_view path) const
+{
+	// pathより前に来ない最初のエントリ番号を返す
+	int lo = 0;
+	int hi = mEntries;
+	while (lo < hi) {
+		int mid = lo + (hi-lo)/2;
+		if (this->path(mid) < path) {
+			lo = mid+1;
+		} else {
+			hi = mid;
 		}
+	}
+	return lo;
+}
+
+};
+
+// =====================================================================
+// サブヘッダからスライスの情報を得る
+// =====================================================================
+
+void
+decodeSubHeader(GasFs::Slice& slice, const GasFs::Database::SubHeader& b)
+{
+	slice.mFiles = (int)getLE(b.mFiles, 3);
+	slice.mTotalSize = getLE(b.mTotalSize, 8);
+	slice.mCRC = getLE(b.mCRC, 4) | (getLE(b.mCRCHigh, 4) << 32);
+	struct tm lt = {0};
+	lt.tm_year = ((b.mDate[0]>>4)*1000)+((b.mDate[0]&0x0f)*100)+((b.mDate[1]>>4)*10)+((b.mDate[1]&0x0f)*1) - 1900;
+	lt.tm_mon = ((b.mDate[2]>>4)*10)+((b.mDate[2]&0x0f)*1) - 1;
+	lt.tm_mday = ((b.mDate[3]>>4)*10)+((b.mDate[3]&0x0f)*1);
+	lt.tm_hour = ((b.mDate[4]>>4)*10)+((b.mDate[4]&0x0f)*1);
+	lt.tm_min = ((b.mDate[5]>>4)*10)+((b.mDate[5]&0x0f)*1);
+	lt.tm_sec = ((b.mDate[6]>>4)*10)+((b.mDate[6]&0x0f)*1);
+	slice.mLastModifiedTime = (uint64_t)mktime(&lt);
+}
 
+// =====================================================================
+// スライスファイルのチェック
+// =====================================================================
+
+int
+checkSlice(GasFs::Global& global, int slice, const GasFs::Database::SubHeader& subheader)
+{
+	char str[16];
+	sprintf(str, "_%03d.gfs", slice);
+	std::string filename = global.mSliceFilename + std::string(str);
+	MY_FILE fin = my_fopen(filename.c_str(), "rb");
+	if (fin == nullptr) {
+		my_printerr("Failed: Cannot open [%s].\n", filename.c_str());
+		return -1;
 	}
+	GasFs::Database::SubHeader b = {0};
+	size_t readsize = my_fread(&b, 1, sizeof(b), fin);
 
-	// データベースエントリを読む
-	GasFs::Database::Entry* ent = (GasFs::Database::Entry*)p;
-	p += sizeof(GasFs::Database::Entry)*entries;
-	for (int i=0; i<entries; i++) {
-		GasFs::Database::Entry* e = &ent[i];
-		GasFs::Entry entry;
-		entry.mSlice = e->mSlice[0];
-		size_t pathofs = (e->mPathOfs[0]<<0) | (e->mPathOfs[1]<<8) | (e->mPathOfs[2]<<16);
-		const std::string path((char*)(p+pathofs));
-		entry.mOffset = (e->mOffset[0]<<0) | (e->mOffset[1]<<8) | (e->mOffset[2]<<16) | (e->mOffset[3]<<24) | ((uint64_t)e->mOffset[4]<<32) | ((uint64_t)e->mOffset[5]<<40);
-		entry.mSize = (e->mSize[0]<<0) | (e->mSize[1]<<8) | (e->mSize[2]<<16) | (e->mSize[3]<<24) | ((uint64_t)e->mSize[4]<<32) | ((uint64_t)e->mSize[5]<<40);
-		map.insert(std::make_pair(path, entry));
+	// スライスファイルのサイズを得ておく
+	my_fseek(fin, 0, SEEK_END);
+	my_fpos_t pos;
+	my_fgetpos(fin, &pos);
+	uint64_t datasize = pos - sizeof(GasFs::Database::SubHeader);
+
+	my_fclose(fin);
+	if (readsize != sizeof(b)) {
+		my_printerr("Failed: Cannot read [%s].\n", filename.c_str());
+		return -1;
+	}
+	if (memcmp(&b, &subheader, sizeof(b))) {
+		my_printerr("Failed: Slice[%d] SubHeader are different [%s].\n", slice, filename.c_str());
+		return -1;
 	}
+	decodeSubHeader(global.mSlice[slice], b);
+	uint64_t totalSize = global.mSlice[slice].mTotalSize;
 
-	global.mSlices = slices;
-	global.mMaxSliceSize = maxSliceSize;
-	return slices;
+	if (totalSize != datasize) {
+		my_printerr("Failed: Database size error(header=%" PRIx64 ", data=%" PRIx64 ") [%s].\n", totalSize, datasize, filename.c_str());
+		return -1;
+	}
+
+	return 0;
 }
 
 // =====================================================================
-// CRCの計算
+// スライスマップの作成
 // =====================================================================
 
-uint32_t
-GetCRC(uint8_t* buf, uint32_t bufsiz, uint32_t crc)
-{
-	static uint32_t table[256] = {0};
-	const uint32_t magic = 0xedb88320;
-	crc ^= 0xffffffff;
-
-	if (table[0] == 0) {
-		for (int i=0; i<256; i++) {
-			uint32_t t = i;
-			for (int j=0; j<8; j++) {
-				int b = t & 1;
-				t >>= 1;
-				if (b) t^= magic;
-			}
-			table[i] = t;
+int
+createMap(GasFs::Global& global, GasFs::Map& map)
+{
+	// データベースファイルを開く
+	std::string filename = global.mSliceFilename+"_000.gfs";
+	GasFs::Database::View view;
+	int slices = view.open(filename);
+	if (slices < 0) {
+		return -1;
+	}
+	global.mSlice.resize(slices+1);
+
+	// スライスファイルのチェック
+	for (int i=1; i<=slices; i++) {
+		int ret = checkSlice(global, i, view.subHeader(i));
+		if (ret < 0) {
+			return -1;
 		}
 	}
-	while (bufsiz--) {
-		crc = table[(crc ^ *(buf++)) & 0xff] ^ (crc >> 8);
+
+	// データベースエントリを読む
+	int entries = view.entries();
+	for (int i=0; i<entries; i++) {
+		const std::string path(view.path(i));
+		map.insert(std::make_pair(path, view.entry(i)));
 	}
 
-	return crc ^ 0xffffffff;
+	global.mSlices = slices;
+	global.mMaxSliceSize = view.maxSliceSize();
+	global.mHasFileCRC = view.hasFileCRC();
+	global.mChunkSize = view.chunkSize();
+	global.mChecksum = view.checksumType();
+	for (int i=1; i<=slices; i++) {
+		std::vector<uint32_t>& chunkCRC = global.mSlice[i].mChunkCRC;
+		chunkCRC.resize((size_t)view.chunks(i));
+		for (size_t k=0; k<chunkCRC.size(); k++) {
+			chunkCRC[k] = view.chunkCRC(i, k);
+		}
+	}
+	return slices;
 }
 
 // =====================================================================
@@ -10,12 +10,35 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <set>
+#include <chrono>
+#include <tuple>
+#include <functional>
 
 #define GASFS_VERSION "20210525a"
 #define GASFS_MARK "GFS3"
 #define GASFS_SUBMARK "gFS3"
+#define GASFS_VERIFYMARK "gFV3"
+
+// ヘッダのフラグ
+#define GASFS_FLAG_EXTENSION 0x01	// 拡張セクションあり
+#define GASFS_FLAG_XXH3 0x02	// チェックサムにXXH3-64を使う
+
+// 拡張セクションのタグ
+#define GASFS_EXT_HASHINDEX "HIDX"	// パス名のハッシュインデックス
+#define GASFS_EXT_FILECRC "FCRC"	// ファイルごとのCRC
+#define GASFS_EXT_CHUNKCRC "CCRC"	// スライスのチャンクごとのCRC
+
+// mkgasfsが記録するチャンクのサイズ
+#define GASFS_CHUNK_SIZE (1024*1024)
 
 namespace GasFs {
 
@@ -23,13 +46,30 @@ namespace GasFs {
 // アーカイブデータ構造
 // -------------------------------------------------------------
 
+// チェックサムの種類
+enum ChecksumType {
+	CHECKSUM_CRC32 = 0,	// 既定、旧版と互換
+	CHECKSUM_XXH3,		// XXH3-64
+};
+
+// CRCの計算処理の種類
+// GetCRC()は使える中でいちばん速いものを選ぶ
+enum CRCKernel {
+	CRC_KERNEL_TABLE = 0,	// slice-by-16、どのCPUでも使える
+	CRC_KERNEL_PCLMUL,		// x86 PCLMULQDQ
+	CRC_KERNEL_ARM,			// ARMv8 CRC32命令(未検証のため、GetCRC()では選ばない)
+	CRC_KERNEL_MAX
+};
+
 struct Slice {
 	bool mNoAddFreeFile;
+	bool mDirty;	// 収録するファイルが前回と異なる
 	int mFiles;
 	int64_t mRest;
 	uint64_t mLastModifiedTime;
 	uint64_t mTotalSize;
-	uint32_t mCRC;
+	uint64_t mCRC;	// CRC32の場合は下位32bitのみ
+	std::vector<uint32_t> mChunkCRC;
 	std::string mFilename;
 };
 
@@ -39,6 +79,9 @@ struct Global {
 	int mMaxSliceSize;
 	bool mSkipCheckCRC;
 	bool mForce;
+	bool mHasFileCRC;
+	uint32_t mChunkSize;
+	ChecksumType mChecksum;
 	uint64_t mLastModifiedTime;
 	std::string mGFIFilename;
 	std::string mSliceFilename;
@@ -51,6 +94,7 @@ struct Entry {
 	uint64_t mOffset;
 	uint64_t mSize;
 	uint64_t mLastModifiedTime;
+	uint32_t mCRC;
 };
 
 typedef std::map<const std::string, Entry> Map;
@@ -66,8 +110,8 @@ struct Header_GFS3 {
 	uint8_t mMaxSliceSize[4];
 	uint8_t mCRC[4];
 	uint8_t mDate[7];
-	uint8_t mDummy1b[1];
-	uint8_t mDummy1c[4];
+	uint8_t mFlags[1];
+	uint8_t mExtOfs[4];
 };
 typedef Header_GFS3 Header;
 
@@ -80,7 +124,7 @@ struct SubHeader_GFS3 {
 	uint8_t mCRC[4];
 	uint8_t mDate[7];
 	uint8_t mDummy1b[1];
-	uint8_t mDummy1c[4];
+	uint8_t mCRCHigh[4];	// XXH3の場合、チェックサムの上位32bit
 };
 typedef SubHeader_GFS3 SubHeader;
 
@@ -91,6 +135,11 @@ struct Entry {
 	uint8_t mSize[6];
 };
 
+struct ExtSection {
+	uint8_t mTag[4];
+	uint8_t mSize[4];
+};
+
 struct Header_GFS2 {
 	uint8_t mMark[3];
 	uint8_t mVersion[1];
@@ -112,6 +161,443 @@ struct SubHeader_GFS2 {
 	uint8_t mDummy[9];
 };
 
+// -------------------------------------------------------------
+// データベースファイルを直接参照するビュー
+// ファイルをメモリにマップし、エントリやパス名を複製せずに参照する
+// -------------------------------------------------------------
+
+class View
+{
+public:		// function
+	View();
+	~View();
+	View(const View&) = delete;
+	View& operator=(const View&) = delete;
+
+	int open(const std::string& filename, bool checkCRC=true);
+	void close();
+	bool isOpen() const { return mData != nullptr; }
+
+	int slices() const { return mSlices; }
+	int entries() const { return mEntries; }
+	int maxSliceSize() const { return mMaxSliceSize; }
+	ChecksumType checksumType() const { return mChecksumType; }
+	const SubHeader& subHeader(int slice) const { return mSubHeader[slice-1]; }
+
+	std::string_view path(int n) const;
+	int slice(int n) const { return mEntry[n].mSlice[0]; }
+	uint64_t offset(int n) const;
+	uint64_t size(int n) const;
+	bool hasFileCRC() const { return mFileCRC != nullptr; }
+	uint32_t fileCRC(int n) const;
+	uint32_t chunkSize() const { return mChunkSize; }
+	uint64_t chunks(int slice) const;
+	uint32_t chunkCRC(int slice, uint64_t chunk) const;
+	GasFs::Entry entry(int n) const;
+	int find(std::string_view path) const;
+	int lowerBound(std::string_view path) const;
+
+private:	// var
+	void* mMap;
+	const uint8_t* mData;
+	size_t mDataSize;
+	const SubHeader* mSubHeader;
+	const Entry* mEntry;
+	const char* mPath;
+	size_t mPathSize;
+	const uint8_t* mHashIndex;
+	uint32_t mHashBuckets;
+	const uint8_t* mFileCRC;
+	const uint8_t* mChunkCRC;
+	uint32_t mChunkSize;
+	std::vector<uint64_t> mChunkBase;	// スライスごとの最初のチャンクの番号
+	int mSlices;
+	int mEntries;
+	int mMaxSliceSize;
+	ChecksumType mChecksumType;
+};
+
+};
+
+// -------------------------------------------------------------
+// スライス読み込みのブロックキャッシュ
+// (スライス番号, ブロック番号)をキーに、上限バイト数までブロックを保持する
+// ロック競合を避けるためシャードに分け、シャードごとにLRUで追い出す
+// -------------------------------------------------------------
+
+class BlockCache
+{
+public:		// struct, enum
+	struct Stats {
+		uint64_t mHits;
+		uint64_t mMisses;
+		uint64_t mEvictions;
+		uint64_t mBytes;
+	};
+
+public:		// function
+	BlockCache(size_t budget, size_t blockSize=64*1024, int shards=16);
+	~BlockCache();
+	BlockCache(const BlockCache&) = delete;
+	BlockCache& operator=(const BlockCache&) = delete;
+
+	int64_t get(int slice, uint64_t block, size_t offset, size_t len, void* buf);
+	void put(int slice, uint64_t block, const void* data, size_t size);
+	void clear();
+
+	size_t budget() const { return mBudget; }
+	size_t blockSize() const { return mBlockSize; }
+	Stats stats() const;
+
+private:	// struct, enum
+	struct Block {
+		uint64_t mKey;
+		std::vector<uint8_t> mData;
+	};
+	struct Shard {
+		std::mutex mMutex;
+		std::list<Block> mLRU;
+		std::unordered_map<uint64_t, std::list<Block>::iterator> mIndex;
+		size_t mBytes;
+	};
+
+private:	// function
+	Shard& shardOf(uint64_t key);
+
+private:	// var
+	size_t mBudget;
+	size_t mBlockSize;
+	size_t mShardBudget;
+	int mShards;
+	std::unique_ptr<Shard[]> mShard;
+	std::atomic<uint64_t> mHits;
+	std::atomic<uint64_t> mMisses;
+	std::atomic<uint64_t> mEvictions;
+};
+
+// -------------------------------------------------------------
+// アーカイブからの読み込み
+// スライスファイルはスライスごとに1つだけ開き、位置指定読み込みで共用する
+// スライスのサブヘッダとサイズは、そのスライスを最初に読むときに確認する
+// open()/close()以外は複数のスレッドから同時に呼んでよい
+// -------------------------------------------------------------
+
+class Archive
+{
+public:		// struct, enum
+	// readMany()の1要求分
+	// mBufにはファイル全体が入る大きさを用意しておき、mResultに読めたバイト数(失敗時は-1)が入る
+	// mBufSizeまたはファイルサイズの小さい方を読めなかったときも失敗になる
+	struct ReadRequest {
+		std::string_view mPath;
+		void* mBuf;
+		size_t mBufSize;
+		int64_t mResult;
+	};
+
+public:		// function
+	Archive();
+	~Archive();
+	Archive(const Archive&) = delete;
+	Archive& operator=(const Archive&) = delete;
+
+	int open(const std::string& basename);
+	void close();
+
+	bool stat(std::string_view path, GasFs::Entry& entry) const;
+	int64_t read(std::string_view path, uint64_t offset, size_t len, void* buf);
+	int64_t readEntry(int n, uint64_t offset, size_t len, void* buf);
+	int64_t readSlice(int slice, uint64_t offset, size_t len, void* buf);
+	int readMany(std::vector<ReadRequest>& requests, size_t maxGap=64*1024, size_t maxRead=16*1024*1024);
+
+	intptr_t sliceFd(int slice);
+	bool validateSlice(int slice) { return sliceFd(slice) >= 0; }
+	bool validateAll();
+	bool checksumSlice(int slice, uint64_t& crc, int threads=0, bool dropCache=false);
+	bool verifyEntry(int n);
+	void setVerifyChunks(bool verify);
+	bool verifyingChunks() const { return mVerifyChunks; }
+	bool verifyRange(int slice, uint64_t offset, size_t len, const void* buf=nullptr);
+
+	void setCache(size_t budget, size_t blockSize=64*1024);
+	BlockCache::Stats cacheStats() const;
+
+	const Database::View& view() const { return mView; }
+	const GasFs::Global& global() const { return mGlobal; }
+
+private:	// function
+	intptr_t openSlice(int slice);
+	int64_t readCached(int slice, uint64_t offset, size_t len, void* buf);
+	int64_t readSliceRaw(int slice, uint64_t offset, size_t len, void* buf);
+
+private:	// var
+	GasFs::Global mGlobal;
+	Database::View mView;
+	int mSlices;
+	std::unique_ptr<std::atomic<intptr_t>[]> mSliceFd;
+	std::mutex mSliceMutex;
+	std::unique_ptr<BlockCache> mCache;
+	bool mVerifyChunks;
+	std::vector<std::unique_ptr<std::atomic<uint8_t>[]>> mChunkState;	// スライスごと。0:未確認 1:正常 2:CRCエラー
+};
+
+// -------------------------------------------------------------
+// アーカイブの非同期読み込み
+// 1つのスレッドから多数の読み込みを同時に発行し、完了をまとめて受け取る
+// Linuxではio_uringを使い、使えない環境ではスレッドプールとpreadで代用する
+// 1つのAsyncReaderは1つのスレッドから使う
+// -------------------------------------------------------------
+
+class AsyncReader
+{
+public:		// struct, enum
+	struct Completion {
+		uint64_t mUserData;
+		int64_t mResult;	// 読めたバイト数、失敗時は負の値。要求より短いのはスライスの終わりに達したときだけ
+	};
+	struct Buffer {
+		void* mBuf;
+		size_t mSize;
+	};
+
+public:		// function
+	AsyncReader(Archive& archive);
+	~AsyncReader();
+	AsyncReader(const AsyncReader&) = delete;
+	AsyncReader& operator=(const AsyncReader&) = delete;
+
+	bool init(unsigned queueDepth=256, int threads=4);
+	void close();
+	bool registerBuffers(const std::vector<Buffer>& buffers);
+
+	bool submitSlice(int slice, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex=-1);
+	bool submitEntry(int n, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex=-1);
+	int flush();
+	int reap(std::vector<Completion>& completions, int minComplete=0);
+
+	bool usingIoUring() const { return mRing != nullptr; }
+	unsigned queueDepth() const { return mQueueDepth; }
+	unsigned inFlight() const { return mInFlight; }
+
+private:	// struct, enum
+	struct Ring;
+	struct Pool;
+
+private:	// var
+	Archive& mArchive;
+	unsigned mQueueDepth;
+	unsigned mInFlight;
+	Ring* mRing;
+	Pool* mPool;
+};
+
+// -------------------------------------------------------------
+// 優先度と期限つきの読み込みスケジューラ
+// 通常・バックグラウンドの要求はスライスごとにオフセット順に並べ替えて発行し、
+// 緊急の要求と期限の迫った要求は期限順に先に発行する
+// 大きな読み込みはチャンクに分けて発行するので、後から来た緊急の要求が割り込める
+// submit()とcancel()はどのスレッドからでも呼べる。pump()は1つのスレッドから呼ぶ
+// -------------------------------------------------------------
+
+class ReadScheduler
+{
+public:		// struct, enum
+	typedef std::chrono::steady_clock Clock;
+	typedef uint64_t Ticket;	// 0は無効
+
+	enum Priority {
+		PRIORITY_URGENT = 0,		// 今すぐ必要なもの
+		PRIORITY_NORMAL,
+		PRIORITY_BACKGROUND,		// 先読み
+		PRIORITY_MAX
+	};
+
+	enum {
+		RESULT_CANCELED = -1000000,	// cancel()された
+	};
+
+	struct Result {
+		Ticket mTicket;
+		int64_t mResult;	// 読めたバイト数、失敗時は負の値
+		bool mLate;			// 期限を過ぎてから完了した
+	};
+
+public:		// function
+	ReadScheduler(Archive& archive);
+	~ReadScheduler();
+	ReadScheduler(const ReadScheduler&) = delete;
+	ReadScheduler& operator=(const ReadScheduler&) = delete;
+
+	bool init(unsigned queueDepth=64, int threads=4, size_t chunkSize=1024*1024);
+	void close();
+
+	Ticket submit(const std::string& path, uint64_t offset, size_t len, void* buf, Priority priority, Clock::time_point deadline=Clock::time_point::max());
+	Ticket submitEntry(int n, uint64_t offset, size_t len, void* buf, Priority priority, Clock::time_point deadline=Clock::time_point::max());
+	bool cancel(Ticket ticket);
+	int pump(std::vector<Result>& results, bool wait);
+
+	void setPromoteWindow(Clock::duration window) { mPromoteWindow = window; }
+	void setBackgroundDepth(unsigned depth) { mBackgroundDepth = depth; }
+	bool idle();
+
+private:	// struct, enum
+	struct Job {
+		int mSlice;
+		uint64_t mOffset;	// スライス内の位置
+		size_t mLen;
+		uint8_t* mBuf;
+		size_t mIssued;		// 発行済みのバイト数
+		size_t mDone;		// 先頭から続けて読めたバイト数。短いチャンクが返ったらその終わりまでに縮める
+		int mChunks;		// 読み込み中のチャンク数
+		int mPriority;		// 期限が迫るとPRIORITY_URGENTに上がる
+		Clock::time_point mDeadline;
+		uint64_t mSeq;
+		int64_t mError;
+		bool mCanceled;
+	};
+	struct Chunk {		// 読み込み中のチャンク。AsyncReaderのuserDataはこの添字
+		Ticket mTicket;
+		size_t mPos;		// 要求の中の位置
+		size_t mLen;
+		int mPriority;
+	};
+	typedef std::pair<uint64_t, Ticket> QueueKey;	// 次に読む位置, チケット
+	typedef std::tuple<Clock::time_point, uint64_t, Ticket> UrgentKey;	// 期限, 受付順, チケット
+
+private:	// function
+	void enqueue(Ticket ticket, Job& job);
+	void dequeue(Ticket ticket, Job& job);
+	void promote(Clock::time_point now);
+	Ticket pick(int priority);
+	void dispatch();
+	void finish(Ticket ticket, Job& job, std::vector<Result>& results);
+
+private:	// var
+	Archive& mArchive;
+	AsyncReader mReader;
+	std::mutex mMutex;
+	size_t mChunkSize;
+	unsigned mQueueDepth;
+	unsigned mBackgroundDepth;
+	unsigned mInFlight[PRIORITY_MAX];
+	Clock::duration mPromoteWindow;
+	Ticket mNextTicket;
+	std::unordered_map<Ticket, Job> mJobs;
+	std::set<UrgentKey> mUrgent;
+	std::map<int, std::set<QueueKey>> mQueue[PRIORITY_MAX];	// スライスごとの待ち行列
+	std::map<int, uint64_t> mCursor[PRIORITY_MAX];	// スライスごとに最後に発行した位置
+	int mCurrentSlice[PRIORITY_MAX];
+	std::set<std::pair<Clock::time_point, Ticket>> mDeadlines;	// 期限つきで未昇格のもの
+	std::vector<Chunk> mChunk;
+	std::vector<uint32_t> mFreeChunk;
+	std::vector<AsyncReader::Completion> mCompletions;
+	std::vector<Result> mFinished;	// pump()で返すのを待っている結果
+};
+
+// -------------------------------------------------------------
+// チェックサムの逐次計算
+// CRC32はGetCRC()と、XXH3はXXH3_64bits()と同じ値になる
+// -------------------------------------------------------------
+
+class Checksum
+{
+public:		// function
+	explicit Checksum(ChecksumType type=CHECKSUM_CRC32);
+	~Checksum();
+	Checksum(const Checksum&) = delete;
+	Checksum& operator=(const Checksum&) = delete;
+
+	ChecksumType type() const { return mType; }
+	void reset();
+	void update(const uint8_t* buf, size_t bufsiz);
+	uint64_t digest() const;
+
+private:	// var
+	ChecksumType mType;
+	uint32_t mCRC;
+	void* mState;	// XXH3_state_t
+};
+
+// -------------------------------------------------------------
+// 確認済みスライスのキャッシュ
+// CRCを確認したスライスを、サブヘッダとファイルのサイズ・更新時刻・inodeを
+// キーにしてファイルに記録しておき、次回以降の確認を省く
+// サブヘッダが同一なら内容も同一なので、ファイルが変わっていなければ確認済みとしてよい
+// -------------------------------------------------------------
+
+class VerifyCache
+{
+public:		// function
+	VerifyCache();
+	~VerifyCache();
+
+	bool load(const std::string& filename);
+	bool save();
+
+	bool isVerified(intptr_t fd, const Database::SubHeader& subheader) const;
+	void setVerified(intptr_t fd, const Database::SubHeader& subheader);
+
+private:	// struct, enum
+	enum {
+		MAX_RECORDS = 4096,	// これを超えたら古いものから捨てる
+	};
+
+	// ファイル上のレコード
+	struct Record {
+		uint8_t mSubHeader[32];
+		uint8_t mSize[8];
+		uint8_t mMTime[8];
+		uint8_t mDev[8];
+		uint8_t mInode[8];
+	};
+
+private:	// function
+	static bool makeRecord(intptr_t fd, const Database::SubHeader& subheader, Record& record);
+	static bool readRecords(const std::string& filename, std::vector<Record>& records);
+
+private:	// var
+	std::string mFilename;
+	std::vector<Record> mRecords;	// 古い順
+	std::vector<Record> mAdded;		// まだ保存していないもの
+};
+
+// -------------------------------------------------------------
+// 読み込み・チェックサム・書き込みを重ねて行うコピー
+// 読み込みは呼び出したスレッドで、チェックサムと書き込みはそれぞれ専用のスレッドで行い、
+// あらかじめ確保したアラインメント済みのバッファを輪にして段の間で受け渡す
+// 各段の関数は、バッファの順に1つずつ呼ばれる
+// 1つのバッファに収まる大きさなら、スレッドを使わずにその場で済ませる
+// 1つのCopyPipelineは1つのスレッドから使う
+// -------------------------------------------------------------
+
+class CopyPipeline
+{
+public:		// struct, enum
+	// bufにsizeバイト以下を読み、読めたバイト数を返す。終端なら0、失敗時は負の値
+	typedef std::function<int64_t(uint8_t* buf, size_t size)> Reader;
+	// 失敗時はfalseを返す
+	typedef std::function<bool(const uint8_t* buf, size_t size)> Stage;
+
+public:		// function
+	CopyPipeline(size_t bufSize=4*1024*1024, int buffers=4);
+	~CopyPipeline();
+	CopyPipeline(const CopyPipeline&) = delete;
+	CopyPipeline& operator=(const CopyPipeline&) = delete;
+
+	int64_t run(uint64_t size, const Reader& reader, const Stage& checksum, const Stage& writer);
+	size_t bufferSize() const { return mBufSize; }
+
+private:	// struct, enum
+	struct Engine;
+
+private:	// function
+	bool allocBuffers();
+
+private:	// var
+	size_t mBufSize;
+	int mBuffers;
+	std::vector<uint8_t*> mBuf;
+	Engine* mEngine;
 };
 
 // -------------------------------------------------------------
@@ -119,9 +605,36 @@ struct SubHeader_GFS2 {
 int
 createMap(GasFs::Global& global, GasFs::Map& map);
 
+int
+checkSlice(GasFs::Global& global, int slice, const GasFs::Database::SubHeader& subheader);
+
+void
+decodeSubHeader(GasFs::Slice& slice, const GasFs::Database::SubHeader& subheader);
+
 uint32_t
 GetCRC(uint8_t* buf, uint32_t bufsiz, uint32_t crc=0);
 
+bool
+HasCRCKernel(CRCKernel kernel);
+
+uint32_t
+GetCRCKernel(CRCKernel kernel, const uint8_t* buf, size_t bufsiz, uint32_t crc=0);
+
+uint32_t
+CombineCRC(uint32_t crcA, uint32_t crcB, uint64_t lenB);
+
+uint32_t
+GetCRCParallel(const uint8_t* buf, size_t bufsiz, uint32_t crc=0, int threads=0);
+
+uint64_t
+GetChecksum(ChecksumType type, const uint8_t* buf, size_t bufsiz);
+
+uint64_t
+GetPathHash(const char* path, size_t len);
+
+bool
+MakeHashIndex(const std::vector<uint64_t>& hashes, std::vector<uint8_t>& section);
+
 
 // -------------------------------------------------------------
 
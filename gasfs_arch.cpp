@@ -11,6 +11,26 @@
 #include <inttypes.h>
 #include <time.h>
 #include <stdarg.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(_WINDOWS)
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+#endif
+
+#include <string>
 
 #include "GasFs.h"
 
@@ -37,6 +57,16 @@ int my_fgetpos(MY_FILE fp, my_fpos_t* pos)
 	return fgetpos((FILE*)fp, (fpos_t*)pos);
 }
 
+// 2GBを超える位置へ、先頭からの位置でシークする
+int my_fseek64(MY_FILE fp, int64_t offset)
+{
+#if defined(_WINDOWS)
+	return _fseeki64((FILE*)fp, offset, SEEK_SET);
+#else
+	return fseeko((FILE*)fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
 size_t my_fread(void* buf, size_t size, size_t n, MY_FILE fp)
 {
 	return fread(buf, size, n, (FILE*)fp);
@@ -56,6 +86,301 @@ int my_printerr(const char* format, ...)
 	return ret;
 }
 
+// ファイル全体を読み込み専用でメモリにマップする
+const uint8_t* my_mmap(const char* filename, size_t* size, MY_MAP* map)
+{
+#if defined(_WINDOWS)
+	int fd = _open(filename, _O_RDONLY|_O_BINARY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	HANDLE h = (HANDLE)_get_osfhandle(fd);
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx(h, &filesize) || (filesize.QuadPart == 0)) {
+		_close(fd);
+		return nullptr;
+	}
+	HANDLE hmap = CreateFileMappingA(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	_close(fd);
+	if (hmap == nullptr) {
+		return nullptr;
+	}
+	void* p = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+	if (p == nullptr) {
+		CloseHandle(hmap);
+		return nullptr;
+	}
+	*size = (size_t)filesize.QuadPart;
+	*map = (MY_MAP)hmap;
+	return (const uint8_t*)p;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat s;
+	if ((fstat(fd, &s) != 0) || (s.st_size == 0)) {
+		close(fd);
+		return nullptr;
+	}
+	void* p = mmap(nullptr, (size_t)s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return nullptr;
+	}
+	*size = (size_t)s.st_size;
+	*map = nullptr;
+	return (const uint8_t*)p;
+#endif
+}
+
+int my_munmap(MY_MAP map, const uint8_t* p, size_t size)
+{
+#if defined(_WINDOWS)
+	(void)size;
+	UnmapViewOfFile(p);
+	return CloseHandle((HANDLE)map) ? 0 : -1;
+#else
+	(void)map;	// POSIXではマップのハンドルを持たない
+	return munmap((void*)p, size);
+#endif
+}
+
+// 位置指定読み込み用にファイルを開く
+// ファイル位置を共有しないので、同じ記述子を複数のスレッドから同時に使える
+// Windowsでは同期ハンドルだと読み込みが直列化されるため、非同期ハンドルで開く
+// 失敗時は負の値を返す
+MY_FD my_open(const char* filename)
+{
+#if defined(_WINDOWS)
+	size_t len = mbstowcs(nullptr, filename, 0);
+	if (len == (size_t)-1) {
+		return -1;
+	}
+	std::wstring wfilename(len, L'\0');
+	mbstowcs(&wfilename[0], filename, len+1);
+	HANDLE h = CreateFileW(wfilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED, nullptr);
+	if (h == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	return (MY_FD)h;
+#else
+	return (MY_FD)open(filename, O_RDONLY);
+#endif
+}
+
+#if defined(_WINDOWS)
+// 読み込み完了待ちのイベントはスレッドごとに1つ持つ
+struct ReadEvent {
+	HANDLE mEvent;
+	ReadEvent() : mEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr)) {}
+	~ReadEvent() { if (mEvent != nullptr) CloseHandle(mEvent); }
+};
+#endif
+
+int64_t my_pread(MY_FD fd, void* buf, size_t size, uint64_t offset)
+{
+#if defined(_WINDOWS)
+	static thread_local ReadEvent ev;
+	HANDLE h = (HANDLE)fd;
+	uint8_t* p = (uint8_t*)buf;
+	int64_t total = 0;
+	while (size > 0) {
+		DWORD n = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+		OVERLAPPED ov = {0};
+		ov.Offset = (DWORD)(offset & 0xffffffff);
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+		ov.hEvent = ev.mEvent;
+		DWORD readsize = 0;
+		if (!ReadFile(h, p, n, nullptr, &ov) && (GetLastError() != ERROR_IO_PENDING)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) {
+				break;
+			}
+			return -1;
+		}
+		if (!GetOverlappedResult(h, &ov, &readsize, TRUE)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) {
+				break;
+			}
+			return -1;
+		}
+		if (readsize == 0) {
+			break;
+		}
+		p += readsize;
+		offset += readsize;
+		size -= readsize;
+		total += readsize;
+	}
+	return total;
+#else
+	uint8_t* p = (uint8_t*)buf;
+	int64_t total = 0;
+	while (size > 0) {
+		ssize_t readsize = pread((int)fd, p, size, (off_t)offset);
+		if (readsize < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (readsize == 0) {
+			break;
+		}
+		p += readsize;
+		offset += readsize;
+		size -= readsize;
+		total += readsize;
+	}
+	return total;
+#endif
+}
+
+int64_t my_filesize(MY_FD fd)
+{
+#if defined(_WINDOWS)
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx((HANDLE)fd, &filesize)) {
+		return -1;
+	}
+	return (int64_t)filesize.QuadPart;
+#else
+	struct stat s;
+	if (fstat((int)fd, &s) != 0) {
+		return -1;
+	}
+	return (int64_t)s.st_size;
+#endif
+}
+
+int my_close(MY_FD fd)
+{
+#if defined(_WINDOWS)
+	return CloseHandle((HANDLE)fd) ? 0 : -1;
+#else
+	return close((int)fd);
+#endif
+}
+
+// 読み終わった範囲をページキャッシュから追い出す
+// 大きなアーカイブを一度だけ読むときに、他のファイルのキャッシュを押し流さないようにする
+// Windowsには範囲を指定する方法がないので何もしない
+int my_dropcache(MY_FD fd, uint64_t offset, uint64_t size)
+{
+#if defined(_WINDOWS)
+	return 0;
+#elif defined(POSIX_FADV_DONTNEED)
+	return posix_fadvise((int)fd, (off_t)offset, (off_t)size, POSIX_FADV_DONTNEED);
+#else
+	return 0;
+#endif
+}
+
+// ファイルのサイズ・更新時刻・デバイス・inodeを得る
+// Windowsではボリュームのシリアル番号とファイルインデックスを使う
+int my_fileid(MY_FD fd, MY_FILEID* id)
+{
+#if defined(_WINDOWS)
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle((HANDLE)fd, &info)) {
+		return -1;
+	}
+	id->mSize = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	id->mMTime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	id->mDev = info.dwVolumeSerialNumber;
+	id->mInode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	return 0;
+#else
+	struct stat s;
+	if (fstat((int)fd, &s) != 0) {
+		return -1;
+	}
+	id->mSize = (uint64_t)s.st_size;
+#if defined(__APPLE__)
+	id->mMTime = (uint64_t)s.st_mtimespec.tv_sec*1000000000 + (uint64_t)s.st_mtimespec.tv_nsec;
+#else
+	id->mMTime = (uint64_t)s.st_mtim.tv_sec*1000000000 + (uint64_t)s.st_mtim.tv_nsec;
+#endif
+	id->mDev = (uint64_t)s.st_dev;
+	id->mInode = (uint64_t)s.st_ino;
+	return 0;
+#endif
+}
+
+// ファイル名を変更する。変更先がすでにあれば置き換える
+int my_rename(const char* from, const char* to)
+{
+#if defined(_WINDOWS)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+	return rename(from, to);
+#endif
+}
+
+// ファイルをsizeバイトに切り詰める
+int my_truncate(const char* filename, uint64_t size)
+{
+#if defined(_WINDOWS)
+	int fd = _open(filename, _O_RDWR|_O_BINARY);
+	if (fd < 0) {
+		return -1;
+	}
+	int ret = _chsize_s(fd, (__int64)size) ? -1 : 0;
+	_close(fd);
+	return ret;
+#else
+	return truncate(filename, (off_t)size);
+#endif
+}
+
+int my_getpid()
+{
+#if defined(_WINDOWS)
+	return (int)GetCurrentProcessId();
+#else
+	return (int)getpid();
+#endif
+}
+
+// このプロセスのI/Oを、他のI/Oがないときだけ行われるようにする
+int my_setidleio()
+{
+#if defined(_WINDOWS)
+	return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) ? 0 : -1;
+#elif defined(__linux__) && defined(SYS_ioprio_set)
+	const int whoProcess = 1;	// IOPRIO_WHO_PROCESS
+	const int classIdle = 3;	// IOPRIO_CLASS_IDLE
+	return (int)syscall(SYS_ioprio_set, whoProcess, 0, classIdle << 13);
+#elif defined(__APPLE__)
+	return setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE);
+#else
+	return -1;
+#endif
+}
+
+// alignバイト境界に揃えたメモリを確保する。alignは2の累乗
+void* my_alignedalloc(size_t size, size_t align)
+{
+#if defined(_WINDOWS)
+	return _aligned_malloc(size, align);
+#else
+	void* p = nullptr;
+	if (posix_memalign(&p, align, size)) {
+		return nullptr;
+	}
+	return p;
+#endif
+}
+
+void my_alignedfree(void* p)
+{
+#if defined(_WINDOWS)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
 // =====================================================================
 
 };
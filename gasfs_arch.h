@@ -21,10 +21,37 @@ typedef int64_t my_fpos_t;
 MY_FILE my_fopen(const char* filename, const char* mode);
 int my_fseek(MY_FILE fp, long offset, int origin);
 int my_fgetpos(MY_FILE fp, my_fpos_t* pos);
+int my_fseek64(MY_FILE fp, int64_t offset);
 size_t my_fread(void* buf, size_t size, size_t n, MY_FILE fp);
 int my_fclose(MY_FILE fp);
 int my_printerr(const char* format, ...);
 
+typedef void* MY_MAP;
+const uint8_t* my_mmap(const char* filename, size_t* size, MY_MAP* map);
+int my_munmap(MY_MAP map, const uint8_t* p, size_t size);
+
+typedef intptr_t MY_FD;
+MY_FD my_open(const char* filename);
+int64_t my_pread(MY_FD fd, void* buf, size_t size, uint64_t offset);
+int64_t my_filesize(MY_FD fd);
+int my_close(MY_FD fd);
+int my_dropcache(MY_FD fd, uint64_t offset, uint64_t size);
+
+// ファイルの同一性を調べるための情報
+struct MY_FILEID {
+	uint64_t mSize;
+	uint64_t mMTime;	// ナノ秒単位(Windowsは100ナノ秒単位)
+	uint64_t mDev;
+	uint64_t mInode;
+};
+int my_fileid(MY_FD fd, MY_FILEID* id);
+int my_rename(const char* from, const char* to);
+int my_truncate(const char* filename, uint64_t size);
+int my_getpid();
+int my_setidleio();
+void* my_alignedalloc(size_t size, size_t align);
+void my_alignedfree(void* p);
+
 
 // -------------------------------------------------------------
 
@@ -0,0 +1,643 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: アーカイブからの読み込み
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// mSliceFdの値。まだ開いていないスライスは-1
+static const MY_FD SLICE_FD_FAILED = -2;	// 確認に失敗したスライス
+
+// =====================================================================
+// アーカイブを開く
+// =====================================================================
+
+Archive::Archive()
+ : mGlobal()
+ , mSlices(0)
+ , mVerifyChunks(false)
+{
+}
+
+Archive::~Archive()
+{
+	close();
+}
+
+int
+Archive::open(const std::string& basename)
+{
+	close();
+
+	// データベースを開く
+	mGlobal.mSliceFilename = basename;
+	int slices = mView.open(basename+"_000.gfs");
+	if (slices < 0) {
+		return -1;
+	}
+	mGlobal.mSlices = slices;
+	mGlobal.mEntries = mView.entries();
+	mGlobal.mMaxSliceSize = mView.maxSliceSize();
+	mGlobal.mChecksum = mView.checksumType();
+	mGlobal.mSlice.resize(slices+1);
+
+	// スライスの情報はデータベースのサブヘッダから得る
+	// スライスファイルは読み込むときに開いて確認する
+	for (int i=1; i<=slices; i++) {
+		GasFs::decodeSubHeader(mGlobal.mSlice[i], mView.subHeader(i));
+	}
+	mSliceFd.reset(new std::atomic<intptr_t>[slices+1]);
+	for (int i=0; i<=slices; i++) {
+		mSliceFd[i] = -1;
+	}
+
+	// チャンクごとのCRCがあれば、確認済みかどうかを覚えておく場所を作る
+	if (mView.chunkSize() > 0) {
+		mChunkState.resize(slices+1);
+		for (int i=1; i<=slices; i++) {
+			uint64_t chunks = mView.chunks(i);
+			mChunkState[i].reset(new std::atomic<uint8_t>[(size_t)chunks]);
+			for (uint64_t k=0; k<chunks; k++) {
+				mChunkState[i][k] = 0;
+			}
+		}
+	}
+	mSlices = slices;
+	return slices;
+}
+
+void
+Archive::close()
+{
+	for (int i=1; mSliceFd && (i<=mSlices); i++) {
+		MY_FD fd = mSliceFd[i];
+		if (fd >= 0) {
+			my_close(fd);
+		}
+	}
+	mSliceFd.reset();
+	mChunkState.clear();
+	mSlices = 0;
+	mView.close();
+	mGlobal = GasFs::Global();
+}
+
+// =====================================================================
+// スライスファイルの記述子を得る
+// =====================================================================
+
+MY_FD
+Archive::sliceFd(int slice)
+{
+	if ((slice < 1) || (slice > mSlices)) {
+		return -1;
+	}
+	MY_FD fd = mSliceFd[slice].load(std::memory_order_acquire);
+	if (fd >= 0) {
+		return fd;
+	}
+	if (fd == SLICE_FD_FAILED) {
+		return -1;
+	}
+
+	// 開くのは1スレッドだけにする
+	// 確認に失敗したスライスは覚えておき、以降は開き直さずエラーを返す
+	std::lock_guard<std::mutex> lock(mSliceMutex);
+	fd = mSliceFd[slice].load(std::memory_order_relaxed);
+	if (fd == SLICE_FD_FAILED) {
+		return -1;
+	}
+	if (fd < 0) {
+		fd = openSlice(slice);
+		mSliceFd[slice].store((fd >= 0) ? fd : SLICE_FD_FAILED, std::memory_order_release);
+		if (fd < 0) {
+			return -1;
+		}
+	}
+	return fd;
+}
+
+// スライスファイルを開き、サブヘッダとサイズがデータベースと一致するか確認する
+MY_FD
+Archive::openSlice(int slice)
+{
+	char str[16];
+	sprintf(str, "_%03d.gfs", slice);
+	std::string filename = mGlobal.mSliceFilename + std::string(str);
+	MY_FD fd = my_open(filename.c_str());
+	if (fd < 0) {
+		my_printerr("Failed: Cannot open [%s].\n", filename.c_str());
+		return -1;
+	}
+
+	GasFs::Database::SubHeader b = {0};
+	int64_t readsize = my_pread(fd, &b, sizeof(b), 0);
+	if (readsize != sizeof(b)) {
+		my_printerr("Failed: Cannot read [%s].\n", filename.c_str());
+		my_close(fd);
+		return -1;
+	}
+	if (memcmp(&b, &mView.subHeader(slice), sizeof(b))) {
+		my_printerr("Failed: Slice[%d] SubHeader are different [%s].\n", slice, filename.c_str());
+		my_close(fd);
+		return -1;
+	}
+	uint64_t totalSize = mGlobal.mSlice[slice].mTotalSize;
+	uint64_t datasize = (uint64_t)my_filesize(fd) - sizeof(b);
+	if (totalSize != datasize) {
+		my_printerr("Failed: Database size error(header=%" PRIx64 ", data=%" PRIx64 ") [%s].\n", totalSize, datasize, filename.c_str());
+		my_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// =====================================================================
+// 全てのスライスを確認する
+// =====================================================================
+
+bool
+Archive::validateAll()
+{
+	bool ok = true;
+	for (int i=1; i<=mSlices; i++) {
+		if (!validateSlice(i)) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// =====================================================================
+// スライスのCRCを計算する
+// スライスを区間に分けて複数のスレッドで読み、CombineCRCでつなぐ
+// 結果はサブヘッダのmCRCと同じ値になる。threadsが0ならCPUの数だけ使う
+// XXH3は区間ごとの値をつなげないので、1スレッドで先頭から読む
+// 読み込みはファイル上の位置を4MB境界にそろえる
+// dropCacheがtrueなら、読んだ範囲をページキャッシュから追い出す
+// =====================================================================
+
+bool
+Archive::checksumSlice(int slice, uint64_t& crc, int threads, bool dropCache)
+{
+	if (!validateSlice(slice)) {
+		return false;
+	}
+	const uint64_t totalSize = mGlobal.mSlice[slice].mTotalSize;
+
+	// 1スレッドあたり最低16MBにする
+	const uint64_t minRange = 16*1024*1024;
+	if (threads <= 0) {
+		threads = (int)std::thread::hardware_concurrency();
+	}
+	const ChecksumType type = mView.checksumType();
+	if (type != CHECKSUM_CRC32) {
+		threads = 1;
+	}
+	uint64_t ranges = std::min((uint64_t)std::max(threads, 1), (totalSize+minRange-1)/minRange);
+	ranges = std::max(ranges, (uint64_t)1);
+	const uint64_t rangeSize = (totalSize+ranges-1)/ranges;
+
+	std::vector<uint64_t> crcs(ranges, 0);
+	std::atomic<bool> ok(true);
+	const MY_FD fd = sliceFd(slice);
+	auto worker = [&](uint64_t k) {
+		const size_t bufsize = 4*1024*1024;
+		const size_t align = 4096;
+		std::unique_ptr<uint8_t[]> mem(new uint8_t[bufsize+align]);
+		uint8_t* buf = mem.get() + ((align - ((uintptr_t)mem.get() % align)) % align);
+		uint64_t pos = k*rangeSize;
+		uint64_t end = std::min(totalSize, pos+rangeSize);
+		uint32_t crc32 = 0;
+		Checksum sum(type);
+		while (ok && (pos < end)) {
+			uint64_t filepos = pos+sizeof(GasFs::Database::SubHeader);
+			size_t len = (size_t)std::min((uint64_t)(bufsize - filepos%bufsize), end-pos);
+			int64_t readsize = readSliceRaw(slice, pos, len, buf);
+			if (readsize <= 0) {
+				ok = false;
+				break;
+			}
+			if (type == CHECKSUM_CRC32) {
+				// 区間ごとに1スレッドなので、ここでは並列化しない
+				crc32 = GetCRC(buf, (uint32_t)readsize, crc32);
+			} else {
+				sum.update(buf, (size_t)readsize);
+			}
+			if (dropCache) {
+				my_dropcache(fd, filepos, (uint64_t)readsize);
+			}
+			pos += readsize;
+		}
+		crcs[k] = (type == CHECKSUM_CRC32) ? crc32 : sum.digest();
+	};
+	std::vector<std::thread> workers;
+	for (uint64_t k=1; k<ranges; k++) {
+		workers.emplace_back(worker, k);
+	}
+	worker(0);
+	for (std::thread& t: workers) {
+		t.join();
+	}
+	if (!ok) {
+		return false;
+	}
+
+	crc = crcs[0];
+	for (uint64_t k=1; k<ranges; k++) {
+		uint64_t pos = k*rangeSize;
+		crc = CombineCRC((uint32_t)crc, (uint32_t)crcs[k], std::min(totalSize, pos+rangeSize)-pos);
+	}
+	return true;
+}
+
+// =====================================================================
+// ファイルのCRCを確認する
+// データベースにファイルごとのCRCがなければ確認せずにtrueを返す
+// =====================================================================
+
+bool
+Archive::verifyEntry(int n)
+{
+	if ((n < 0) || (n >= mView.entries())) {
+		return false;
+	}
+	if (!mView.hasFileCRC()) {
+		return true;
+	}
+
+	// キャッシュを汚さないよう、スライスから直接読む
+	const int slice = mView.slice(n);
+	const uint64_t offset = mView.offset(n);
+	const uint64_t size = mView.size(n);
+	const size_t bufsize = 1024*1024;
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[(size_t)std::min((uint64_t)bufsize, std::max(size, (uint64_t)1))]);
+	Checksum sum(mView.checksumType());
+	uint64_t pos = 0;
+	while (pos < size) {
+		size_t len = (size_t)std::min((uint64_t)bufsize, size-pos);
+		int64_t readsize = readSliceRaw(slice, offset+pos, len, buf.get());
+		if (readsize <= 0) {
+			return false;
+		}
+		sum.update(buf.get(), (size_t)readsize);
+		pos += readsize;
+	}
+	uint32_t datacrc = (uint32_t)sum.digest();
+	uint32_t crc = mView.fileCRC(n);
+	if (crc != datacrc) {
+		const std::string path(mView.path(n));
+		my_printerr("Failed: File CRC error(header=%08x, data=%08x) [%s].\n", crc, datacrc, path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// =====================================================================
+// チャンクごとのCRCの確認
+// 読み込みが触れたチャンクだけを、初めて触れたときに確認して結果を覚えておく
+// チャンク全体がbufに含まれていればそれを使い、そうでなければチャンクを読み直す
+// =====================================================================
+
+void
+Archive::setVerifyChunks(bool verify)
+{
+	// 読み込み中に切り替えないこと
+	mVerifyChunks = verify && !mChunkState.empty();
+}
+
+bool
+Archive::verifyRange(int slice, uint64_t offset, size_t len, const void* buf)
+{
+	if (mChunkState.empty() || (len == 0)) {
+		return true;
+	}
+	if ((slice < 1) || (slice > mSlices)) {
+		return false;
+	}
+	const uint64_t chunkSize = mView.chunkSize();
+	const uint64_t chunks = mView.chunks(slice);
+	const uint64_t sliceSize = mGlobal.mSlice[slice].mTotalSize;
+	std::atomic<uint8_t>* state = mChunkState[slice].get();
+	std::unique_ptr<uint8_t[]> tmp;
+	for (uint64_t k=offset/chunkSize; (k<=(offset+len-1)/chunkSize) && (k<chunks); k++) {
+		uint8_t st = state[k].load(std::memory_order_acquire);
+		if (st == 1) {
+			continue;
+		}
+		if (st == 0) {
+			const uint64_t chunkOfs = k*chunkSize;
+			const size_t chunkLen = (size_t)std::min(chunkSize, sliceSize-chunkOfs);
+			const uint8_t* data;
+			if ((buf != nullptr) && (chunkOfs >= offset) && (chunkOfs+chunkLen <= offset+len)) {
+				data = (const uint8_t*)buf + (chunkOfs-offset);
+			} else {
+				if (!tmp) {
+					tmp.reset(new uint8_t[(size_t)chunkSize]);
+				}
+				if (readSliceRaw(slice, chunkOfs, chunkLen, tmp.get()) != (int64_t)chunkLen) {
+					return false;
+				}
+				data = tmp.get();
+			}
+			uint32_t datacrc = (uint32_t)GetChecksum(mView.checksumType(), data, chunkLen);
+			uint32_t crc = mView.chunkCRC(slice, k);
+			st = (datacrc == crc) ? 1 : 2;
+			state[k].store(st, std::memory_order_release);
+			if (st == 2) {
+				my_printerr("Failed: Slice[%d] chunk %" PRIu64 " CRC error(header=%08x, data=%08x).\n", slice, k, crc, datacrc);
+			}
+		}
+		if (st == 2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// =====================================================================
+// ファイルの情報を得る
+// =====================================================================
+
+bool
+Archive::stat(std::string_view path, GasFs::Entry& entry) const
+{
+	int n = mView.find(path);
+	if (n < 0) {
+		return false;
+	}
+	entry = mView.entry(n);
+	return true;
+}
+
+// =====================================================================
+// ファイルを読み込む
+// 戻り値は読み込んだバイト数、失敗時は-1
+// =====================================================================
+
+int64_t
+Archive::read(std::string_view path, uint64_t offset, size_t len, void* buf)
+{
+	int n = mView.find(path);
+	if (n < 0) {
+		return -1;
+	}
+	return readEntry(n, offset, len, buf);
+}
+
+int64_t
+Archive::readEntry(int n, uint64_t offset, size_t len, void* buf)
+{
+	if ((n < 0) || (n >= mView.entries())) {
+		return -1;
+	}
+
+	// ファイルの末尾で切り詰める
+	uint64_t size = mView.size(n);
+	if (offset >= size) {
+		return 0;
+	}
+	if (len > size-offset) {
+		len = (size_t)(size-offset);
+	}
+	if (mCache) {
+		return readCached(mView.slice(n), mView.offset(n)+offset, len, buf);
+	}
+	return readSlice(mView.slice(n), mView.offset(n)+offset, len, buf);
+}
+
+int64_t
+Archive::readSlice(int slice, uint64_t offset, size_t len, void* buf)
+{
+	int64_t readsize = readSliceRaw(slice, offset, len, buf);
+	if ((readsize > 0) && mVerifyChunks) {
+		if (!verifyRange(slice, offset, (size_t)readsize, buf)) {
+			return -1;
+		}
+	}
+	return readsize;
+}
+
+int64_t
+Archive::readSliceRaw(int slice, uint64_t offset, size_t len, void* buf)
+{
+	// offsetはサブヘッダ終了後からの位置
+	MY_FD fd = sliceFd(slice);
+	if (fd < 0) {
+		return -1;
+	}
+	int64_t readsize = my_pread(fd, buf, len, offset+sizeof(GasFs::Database::SubHeader));
+	if (readsize < 0) {
+		my_printerr("Failed: Cannot read Slice[%d] (offset=%" PRIu64 ", size=%zu).\n", slice, offset, len);
+	}
+	return readsize;
+}
+
+// =====================================================================
+// 複数ファイルの一括読み込み
+// スライス内のファイルはパス名順に詰めて並んでいるので、同じディレクトリの
+// ファイルはたいてい隣接している。要求をスライスごとにオフセット順に並べ、
+// 間隔がmaxGap以下のものをmaxReadまでの1回の読み込みにまとめてから配る。
+// 戻り値は読めなかった要求の数
+// =====================================================================
+
+int
+Archive::readMany(std::vector<ReadRequest>& requests, size_t maxGap, size_t maxRead)
+{
+	struct Item {
+		int mRequest;
+		int mSlice;
+		uint64_t mOffset;
+		uint64_t mSize;
+	};
+
+	// 要求を解決する
+	int failed = 0;
+	std::vector<Item> items;
+	items.reserve(requests.size());
+	for (int i=0; i<(int)requests.size(); i++) {
+		ReadRequest& req = requests[i];
+		req.mResult = -1;
+		int n = mView.find(req.mPath);
+		if (n < 0) {
+			failed++;
+			continue;
+		}
+		Item item;
+		item.mRequest = i;
+		item.mSlice = mView.slice(n);
+		item.mOffset = mView.offset(n);
+		item.mSize = mView.size(n);
+		if (item.mSize > req.mBufSize) {
+			item.mSize = req.mBufSize;
+		}
+		if (item.mSize == 0) {
+			req.mResult = 0;
+			continue;
+		}
+		items.push_back(item);
+	}
+	std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+		if (a.mSlice != b.mSlice) {
+			return a.mSlice < b.mSlice;
+		}
+		return a.mOffset < b.mOffset;
+	});
+
+	// 隣接する範囲をまとめて読み、各要求のバッファへ写す
+	std::vector<uint8_t> buf;
+	size_t i = 0;
+	while (i < items.size()) {
+		int slice = items[i].mSlice;
+		uint64_t start = items[i].mOffset;
+		uint64_t end = start + items[i].mSize;
+		size_t j = i+1;
+		while (j < items.size()) {
+			const Item& item = items[j];
+			if (item.mSlice != slice) {
+				break;
+			}
+			if (item.mOffset > end+maxGap) {
+				break;
+			}
+			uint64_t newEnd = std::max(end, item.mOffset+item.mSize);
+			if (newEnd-start > maxRead) {
+				break;
+			}
+			end = newEnd;
+			j++;
+		}
+
+		if (j == i+1) {
+			// まとめる相手がなければ、要求のバッファへ直接読む
+			const Item& item = items[i];
+			ReadRequest& req = requests[item.mRequest];
+			req.mResult = readSlice(slice, item.mOffset, (size_t)item.mSize, req.mBuf);
+			if ((req.mResult >= 0) && ((uint64_t)req.mResult != item.mSize)) {
+				my_printerr("Failed: Short read Slice[%d] (offset=%" PRIu64 ", size=%" PRIu64 ").\n", slice, item.mOffset, item.mSize);
+				req.mResult = -1;
+			}
+			if (req.mResult < 0) {
+				failed++;
+			}
+		} else {
+			buf.resize((size_t)(end-start));
+			int64_t readsize = readSlice(slice, start, buf.size(), buf.data());
+			for (size_t k=i; k<j; k++) {
+				const Item& item = items[k];
+				ReadRequest& req = requests[item.mRequest];
+				if (readsize < 0) {
+					failed++;
+					continue;
+				}
+				// スライスが途中で切れていたら、要求した分を読めなかった要求は失敗にする
+				uint64_t ofs = item.mOffset-start;
+				if (ofs+item.mSize > (uint64_t)readsize) {
+					my_printerr("Failed: Short read Slice[%d] (offset=%" PRIu64 ", size=%" PRIu64 ").\n", slice, item.mOffset, item.mSize);
+					failed++;
+					continue;
+				}
+				memcpy(req.mBuf, buf.data()+ofs, (size_t)item.mSize);
+				req.mResult = (int64_t)item.mSize;
+			}
+		}
+		i = j;
+	}
+
+	return failed;
+}
+
+// =====================================================================
+// ブロックキャッシュ経由の読み込み
+// =====================================================================
+
+void
+Archive::setCache(size_t budget, size_t blockSize)
+{
+	// 読み込み中に呼んではいけない
+	if (budget == 0) {
+		mCache.reset();
+		return;
+	}
+	mCache.reset(new BlockCache(budget, blockSize));
+}
+
+BlockCache::Stats
+Archive::cacheStats() const
+{
+	if (!mCache) {
+		BlockCache::Stats stats = {0};
+		return stats;
+	}
+	return mCache->stats();
+}
+
+int64_t
+Archive::readCached(int slice, uint64_t offset, size_t len, void* buf)
+{
+	// キャッシュ容量に比べて大きい読み込みは、キャッシュを素通りさせる
+	if (len >= mCache->budget()/16) {
+		return readSlice(slice, offset, len, buf);
+	}
+
+	size_t blockSize = mCache->blockSize();
+	std::vector<uint8_t> block;
+	uint8_t* p = (uint8_t*)buf;
+	int64_t total = 0;
+	while (len > 0) {
+		uint64_t blockNo = offset / blockSize;
+		size_t ofs = (size_t)(offset % blockSize);
+		size_t size = blockSize - ofs;
+		if (size > len) {
+			size = len;
+		}
+		int64_t readsize = mCache->get(slice, blockNo, ofs, size, p);
+		if (readsize < 0) {
+			// ブロック全体を読んでキャッシュに入れる
+			block.resize(blockSize);
+			int64_t blockReadSize = readSlice(slice, blockNo*blockSize, blockSize, block.data());
+			if (blockReadSize < 0) {
+				return -1;
+			}
+			mCache->put(slice, blockNo, block.data(), (size_t)blockReadSize);
+			readsize = 0;
+			if ((int64_t)ofs < blockReadSize) {
+				readsize = blockReadSize - ofs;
+				if (readsize > (int64_t)size) {
+					readsize = size;
+				}
+				memcpy(p, block.data()+ofs, (size_t)readsize);
+			}
+		}
+		total += readsize;
+		if (readsize < (int64_t)size) {
+			// スライスの末尾に達した
+			break;
+		}
+		p += readsize;
+		offset += readsize;
+		len -= (size_t)readsize;
+	}
+	return total;
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
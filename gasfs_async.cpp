@@ -0,0 +1,591 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: アーカイブの非同期読み込み
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define GASFS_USE_IO_URING
+#endif
+#endif
+
+#if defined(GASFS_USE_IO_URING)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// io_uring
+// liburingには頼らず、システムコールを直接使う
+// =====================================================================
+
+#if defined(GASFS_USE_IO_URING)
+
+struct AsyncReader::Ring {
+	// 発行中の要求
+	// cqeのresが要求より短くても終わりとは限らないので、残りを発行し直す
+	struct Request {
+		int mSlice;
+		int mFd;
+		uint64_t mOffset;
+		size_t mLen;
+		uint8_t* mBuf;
+		uint64_t mUserData;
+		int mBufIndex;
+		size_t mDone;
+	};
+
+	int mFd;
+	void* mSQPtr;
+	size_t mSQSize;
+	void* mCQPtr;
+	size_t mCQSize;
+	io_uring_sqe* mSQEs;
+	size_t mSQEsSize;
+	unsigned* mSQHead;
+	unsigned* mSQTail;
+	unsigned* mSQMask;
+	unsigned* mSQArray;
+	unsigned mSQEntries;
+	unsigned* mCQHead;
+	unsigned* mCQTail;
+	unsigned* mCQMask;
+	io_uring_cqe* mCQEs;
+	unsigned mPending;
+	bool mFixedFiles;
+	bool mFixedBuffers;
+	std::vector<uint8_t> mFileRegistered;
+	std::vector<Request> mRequest;		// user_dataはこの添字
+	std::vector<uint32_t> mFreeRequest;
+
+	Ring()
+	 : mFd(-1), mSQPtr(MAP_FAILED), mSQSize(0), mCQPtr(MAP_FAILED), mCQSize(0)
+	 , mSQEs((io_uring_sqe*)MAP_FAILED), mSQEsSize(0)
+	 , mSQHead(nullptr), mSQTail(nullptr), mSQMask(nullptr), mSQArray(nullptr), mSQEntries(0)
+	 , mCQHead(nullptr), mCQTail(nullptr), mCQMask(nullptr), mCQEs(nullptr)
+	 , mPending(0), mFixedFiles(false), mFixedBuffers(false)
+	{
+	}
+
+	~Ring() {
+		if (mSQEs != MAP_FAILED) {
+			munmap(mSQEs, mSQEsSize);
+		}
+		if ((mCQPtr != MAP_FAILED) && (mCQPtr != mSQPtr)) {
+			munmap(mCQPtr, mCQSize);
+		}
+		if (mSQPtr != MAP_FAILED) {
+			munmap(mSQPtr, mSQSize);
+		}
+		if (mFd >= 0) {
+			::close(mFd);
+		}
+	}
+
+	int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+		while (!0) {
+			int ret = (int)syscall(__NR_io_uring_enter, mFd, toSubmit, minComplete, flags, nullptr, 0);
+			if ((ret < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return ret;
+		}
+	}
+
+	int reg(unsigned opcode, const void* arg, unsigned n) {
+		return (int)syscall(__NR_io_uring_register, mFd, opcode, arg, n);
+	}
+
+	bool init(unsigned entries, int slices) {
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		mFd = (int)syscall(__NR_io_uring_setup, entries, &p);
+		if (mFd < 0) {
+			return false;
+		}
+		// IORING_OP_READが使えるカーネル(5.6以降)に限る
+		if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+			return false;
+		}
+
+		// リングをマップする
+		mSQSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+		mCQSize = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			mSQSize = mCQSize = std::max(mSQSize, mCQSize);
+		}
+		mSQPtr = mmap(nullptr, mSQSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+		if (mSQPtr == MAP_FAILED) {
+			return false;
+		}
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			mCQPtr = mSQPtr;
+		} else {
+			mCQPtr = mmap(nullptr, mCQSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+			if (mCQPtr == MAP_FAILED) {
+				return false;
+			}
+		}
+		mSQEsSize = p.sq_entries*sizeof(io_uring_sqe);
+		mSQEs = (io_uring_sqe*)mmap(nullptr, mSQEsSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQES);
+		if (mSQEs == MAP_FAILED) {
+			return false;
+		}
+		uint8_t* sq = (uint8_t*)mSQPtr;
+		uint8_t* cq = (uint8_t*)mCQPtr;
+		mSQHead = (unsigned*)(sq + p.sq_off.head);
+		mSQTail = (unsigned*)(sq + p.sq_off.tail);
+		mSQMask = (unsigned*)(sq + p.sq_off.ring_mask);
+		mSQArray = (unsigned*)(sq + p.sq_off.array);
+		mSQEntries = p.sq_entries;
+		mCQHead = (unsigned*)(cq + p.cq_off.head);
+		mCQTail = (unsigned*)(cq + p.cq_off.tail);
+		mCQMask = (unsigned*)(cq + p.cq_off.ring_mask);
+		mCQEs = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+		// スライスの記述子は固定ファイルとして登録する
+		// スライス番号をそのまま添字に使い、スライスを開いたときに埋める
+		std::vector<int> fds(slices+1, -1);
+		mFixedFiles = (reg(IORING_REGISTER_FILES, fds.data(), (unsigned)fds.size()) >= 0);
+		mFileRegistered.assign(slices+1, 0);
+		return true;
+	}
+
+	bool registerBuffers(const std::vector<AsyncReader::Buffer>& buffers) {
+		std::vector<iovec> iov(buffers.size());
+		for (size_t i=0; i<buffers.size(); i++) {
+			iov[i].iov_base = buffers[i].mBuf;
+			iov[i].iov_len = buffers[i].mSize;
+		}
+		if (mFixedBuffers) {
+			reg(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		}
+		mFixedBuffers = (reg(IORING_REGISTER_BUFFERS, iov.data(), (unsigned)iov.size()) >= 0);
+		return mFixedBuffers;
+	}
+
+	bool useFixedFile(int slice, int fd) {
+		if (!mFixedFiles) {
+			return false;
+		}
+		if (!mFileRegistered[slice]) {
+			io_uring_files_update up;
+			memset(&up, 0, sizeof(up));
+			up.offset = (unsigned)slice;
+			up.fds = (uint64_t)(uintptr_t)&fd;
+			if (reg(IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+				return false;
+			}
+			mFileRegistered[slice] = 1;
+		}
+		return true;
+	}
+
+	bool submit(int slice, int fd, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex) {
+		uint32_t id;
+		if (mFreeRequest.empty()) {
+			id = (uint32_t)mRequest.size();
+			mRequest.emplace_back();
+		} else {
+			id = mFreeRequest.back();
+			mFreeRequest.pop_back();
+		}
+		Request& req = mRequest[id];
+		req.mSlice = slice;
+		req.mFd = fd;
+		req.mOffset = offset;
+		req.mLen = len;
+		req.mBuf = (uint8_t*)buf;
+		req.mUserData = userData;
+		req.mBufIndex = bufIndex;
+		req.mDone = 0;
+		if (!push(id)) {
+			mFreeRequest.push_back(id);
+			return false;
+		}
+		return true;
+	}
+
+	// 要求の読み残しをSQに積む
+	bool push(uint32_t id) {
+		const Request& req = mRequest[id];
+		unsigned tail = *mSQTail;
+		unsigned head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+		if (tail-head >= mSQEntries) {
+			if (flush() < 0) {
+				return false;
+			}
+			head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+			if (tail-head >= mSQEntries) {
+				return false;
+			}
+		}
+		unsigned index = tail & *mSQMask;
+		io_uring_sqe* sqe = &mSQEs[index];
+		memset(sqe, 0, sizeof(*sqe));
+		if ((req.mBufIndex >= 0) && mFixedBuffers) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->buf_index = (uint16_t)req.mBufIndex;
+		} else {
+			sqe->opcode = IORING_OP_READ;
+		}
+		if (useFixedFile(req.mSlice, req.mFd)) {
+			sqe->fd = req.mSlice;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = req.mFd;
+		}
+		sqe->off = req.mOffset + req.mDone;
+		sqe->addr = (uint64_t)(uintptr_t)(req.mBuf + req.mDone);
+		sqe->len = (uint32_t)(req.mLen - req.mDone);
+		sqe->user_data = id;
+		mSQArray[index] = index;
+		__atomic_store_n(mSQTail, tail+1, __ATOMIC_RELEASE);
+		mPending++;
+		return true;
+	}
+
+	int flush() {
+		int submitted = 0;
+		while (mPending > 0) {
+			int ret = enter(mPending, 0, 0);
+			if (ret < 0) {
+				return -1;
+			}
+			mPending -= ret;
+			submitted += ret;
+		}
+		return submitted;
+	}
+
+	int harvest(std::vector<AsyncReader::Completion>& completions) {
+		unsigned head = *mCQHead;
+		unsigned tail = __atomic_load_n(mCQTail, __ATOMIC_ACQUIRE);
+		int n = 0;
+		std::vector<uint32_t> retry;
+		while (head != tail) {
+			const io_uring_cqe* cqe = &mCQEs[head & *mCQMask];
+			uint32_t id = (uint32_t)cqe->user_data;
+			int res = cqe->res;
+			head++;
+
+			// 途中までしか読めなかったら、ファイルの終わり(0)か失敗になるまで残りを読む
+			Request& req = mRequest[id];
+			if (res > 0) {
+				req.mDone += res;
+				if (req.mDone < req.mLen) {
+					retry.push_back(id);
+					continue;
+				}
+			}
+			AsyncReader::Completion c;
+			c.mUserData = req.mUserData;
+			c.mResult = (res < 0) ? res : (int64_t)req.mDone;
+			completions.push_back(c);
+			mFreeRequest.push_back(id);
+			n++;
+		}
+		__atomic_store_n(mCQHead, head, __ATOMIC_RELEASE);
+
+		// CQを空けてから発行し直す。発行できなければ失敗として返す
+		for (uint32_t id: retry) {
+			if (!push(id)) {
+				AsyncReader::Completion c;
+				c.mUserData = mRequest[id].mUserData;
+				c.mResult = -EAGAIN;
+				completions.push_back(c);
+				mFreeRequest.push_back(id);
+				n++;
+			}
+		}
+		return n;
+	}
+
+	int reap(std::vector<AsyncReader::Completion>& completions, int minComplete) {
+		if (flush() < 0) {
+			return -1;
+		}
+		int n = harvest(completions);
+		while (n < minComplete) {
+			// 発行し直した要求があれば、待つついでに発行する
+			int ret = enter(mPending, minComplete-n, IORING_ENTER_GETEVENTS);
+			if (ret < 0) {
+				return -1;
+			}
+			mPending -= std::min((unsigned)ret, mPending);
+			n += harvest(completions);
+		}
+		return n;
+	}
+};
+
+#else
+
+struct AsyncReader::Ring {
+	bool init(unsigned entries, int slices) { return false; }
+	bool registerBuffers(const std::vector<AsyncReader::Buffer>& buffers) { return false; }
+	bool submit(int slice, intptr_t fd, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex) { return false; }
+	int flush() { return -1; }
+	int reap(std::vector<AsyncReader::Completion>& completions, int minComplete) { return -1; }
+};
+
+#endif
+
+// =====================================================================
+// スレッドプール
+// io_uringが使えないときに、ワーカースレッドでpreadを発行する
+// =====================================================================
+
+struct AsyncReader::Pool {
+	struct Request {
+		MY_FD mFd;
+		uint64_t mOffset;
+		size_t mLen;
+		void* mBuf;
+		uint64_t mUserData;
+	};
+
+	std::mutex mMutex;
+	std::condition_variable mWork;
+	std::condition_variable mDone;
+	std::deque<Request> mQueue;
+	std::vector<AsyncReader::Completion> mCompletions;
+	std::vector<std::thread> mThreads;
+	bool mStop;
+
+	Pool(int threads)
+	 : mStop(false)
+	{
+		for (int i=0; i<threads; i++) {
+			mThreads.emplace_back([this]() { worker(); });
+		}
+	}
+
+	~Pool() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		mWork.notify_all();
+		for (std::thread& t: mThreads) {
+			t.join();
+		}
+	}
+
+	void worker() {
+		while (!0) {
+			Request req;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mWork.wait(lock, [this]() { return mStop || !mQueue.empty(); });
+				if (mQueue.empty()) {
+					return;
+				}
+				req = mQueue.front();
+				mQueue.pop_front();
+			}
+			AsyncReader::Completion c;
+			c.mUserData = req.mUserData;
+			c.mResult = my_pread(req.mFd, req.mBuf, req.mLen, req.mOffset);
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mCompletions.push_back(c);
+			}
+			mDone.notify_one();
+		}
+	}
+
+	bool submit(MY_FD fd, uint64_t offset, size_t len, void* buf, uint64_t userData) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			Request req = { fd, offset, len, buf, userData };
+			mQueue.push_back(req);
+		}
+		mWork.notify_one();
+		return true;
+	}
+
+	int reap(std::vector<AsyncReader::Completion>& completions, int minComplete) {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDone.wait(lock, [&]() { return (int)mCompletions.size() >= minComplete; });
+		int n = (int)mCompletions.size();
+		completions.insert(completions.end(), mCompletions.begin(), mCompletions.end());
+		mCompletions.clear();
+		return n;
+	}
+};
+
+// =====================================================================
+// 非同期読み込みの準備
+// =====================================================================
+
+AsyncReader::AsyncReader(Archive& archive)
+ : mArchive(archive)
+ , mQueueDepth(0)
+ , mInFlight(0)
+ , mRing(nullptr)
+ , mPool(nullptr)
+{
+}
+
+AsyncReader::~AsyncReader()
+{
+	close();
+}
+
+bool
+AsyncReader::init(unsigned queueDepth, int threads)
+{
+	close();
+	mQueueDepth = queueDepth;
+
+	// io_uringを試し、だめならスレッドプールにする
+	Ring* ring = new Ring;
+	if (ring->init(queueDepth, mArchive.view().slices())) {
+		mRing = ring;
+		return true;
+	}
+	delete ring;
+
+	if (threads < 1) {
+		threads = 1;
+	}
+	mPool = new Pool(threads);
+	return true;
+}
+
+void
+AsyncReader::close()
+{
+	// 読み込み中の要求の完了を待ってから閉じる
+	if (mInFlight > 0) {
+		std::vector<Completion> completions;
+		reap(completions, (int)mInFlight);
+	}
+	delete mRing;
+	mRing = nullptr;
+	delete mPool;
+	mPool = nullptr;
+	mInFlight = 0;
+}
+
+bool
+AsyncReader::registerBuffers(const std::vector<Buffer>& buffers)
+{
+	// スレッドプールでは登録の必要がない
+	if (mRing == nullptr) {
+		return true;
+	}
+	return mRing->registerBuffers(buffers);
+}
+
+// =====================================================================
+// 読み込み要求の発行
+// 同時に発行できるのはqueueDepth個まで。それを超えるときはreap()で完了を受け取る
+// =====================================================================
+
+bool
+AsyncReader::submitSlice(int slice, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex)
+{
+	if ((mRing == nullptr) && (mPool == nullptr)) {
+		return false;
+	}
+	if ((mInFlight >= mQueueDepth) || (len > 0x7ffff000)) {
+		return false;
+	}
+	MY_FD fd = mArchive.sliceFd(slice);
+	if (fd < 0) {
+		return false;
+	}
+	offset += sizeof(GasFs::Database::SubHeader);
+	bool ok;
+	if (mRing != nullptr) {
+		ok = mRing->submit(slice, (int)fd, offset, len, buf, userData, bufIndex);
+	} else {
+		ok = mPool->submit(fd, offset, len, buf, userData);
+	}
+	if (ok) {
+		mInFlight++;
+	}
+	return ok;
+}
+
+bool
+AsyncReader::submitEntry(int n, uint64_t offset, size_t len, void* buf, uint64_t userData, int bufIndex)
+{
+	const Database::View& view = mArchive.view();
+	if ((n < 0) || (n >= view.entries())) {
+		return false;
+	}
+
+	// ファイルの末尾で切り詰める
+	uint64_t size = view.size(n);
+	if (offset > size) {
+		offset = size;
+	}
+	if (len > size-offset) {
+		len = (size_t)(size-offset);
+	}
+	return submitSlice(view.slice(n), view.offset(n)+offset, len, buf, userData, bufIndex);
+}
+
+int
+AsyncReader::flush()
+{
+	if (mRing != nullptr) {
+		return mRing->flush();
+	}
+	return 0;
+}
+
+// =====================================================================
+// 完了の受け取り
+// 少なくともminComplete個の完了を待ち、受け取った数を返す
+// =====================================================================
+
+int
+AsyncReader::reap(std::vector<Completion>& completions, int minComplete)
+{
+	if (minComplete > (int)mInFlight) {
+		minComplete = (int)mInFlight;
+	}
+	int n = -1;
+	if (mRing != nullptr) {
+		n = mRing->reap(completions, minComplete);
+	} else if (mPool != nullptr) {
+		n = mPool->reap(completions, minComplete);
+	}
+	if (n > 0) {
+		mInFlight -= n;
+	}
+	return n;
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
@@ -0,0 +1,167 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: スライス読み込みのブロックキャッシュ
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// キャッシュの作成
+// 各シャードが少なくとも1ブロック持てるように、シャード数を減らす
+// 容量が1ブロックに満たないときは、1シャードに1ブロックだけ持つ
+// =====================================================================
+
+static int
+ClampShards(size_t budget, size_t blockSize, int shards)
+{
+	size_t blocks = (blockSize > 0) ? (budget / blockSize) : budget;
+	if ((size_t)shards > blocks) {
+		shards = (int)blocks;
+	}
+	return (shards < 1) ? 1 : shards;
+}
+
+BlockCache::BlockCache(size_t budget, size_t blockSize, int shards)
+ : mBudget(budget)
+ , mBlockSize(blockSize)
+ , mShardBudget(0)
+ , mShards(ClampShards(budget, blockSize, shards))
+ , mShard(new Shard[mShards])
+ , mHits(0)
+ , mMisses(0)
+ , mEvictions(0)
+{
+	mShardBudget = std::max(budget / mShards, blockSize);
+	for (int i=0; i<mShards; i++) {
+		mShard[i].mBytes = 0;
+	}
+}
+
+BlockCache::~BlockCache()
+{
+}
+
+void
+BlockCache::clear()
+{
+	for (int i=0; i<mShards; i++) {
+		Shard& shard = mShard[i];
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		shard.mIndex.clear();
+		shard.mLRU.clear();
+		shard.mBytes = 0;
+	}
+}
+
+BlockCache::Shard&
+BlockCache::shardOf(uint64_t key)
+{
+	uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+	return mShard[(size_t)((h>>32) % (uint64_t)mShards)];
+}
+
+// =====================================================================
+// キャッシュからの取り出し
+// ブロックのoffsetからlenバイトをbufへ写し、写したバイト数を返す
+// ブロックがキャッシュになければ-1を返す
+// =====================================================================
+
+int64_t
+BlockCache::get(int slice, uint64_t block, size_t offset, size_t len, void* buf)
+{
+	uint64_t key = ((uint64_t)slice<<56) | block;
+	Shard& shard = shardOf(key);
+	std::lock_guard<std::mutex> lock(shard.mMutex);
+	auto it = shard.mIndex.find(key);
+	if (it == shard.mIndex.end()) {
+		mMisses++;
+		return -1;
+	}
+
+	// 使ったブロックをLRUの先頭へ移す
+	shard.mLRU.splice(shard.mLRU.begin(), shard.mLRU, it->second);
+	const std::vector<uint8_t>& data = it->second->mData;
+	mHits++;
+	if (offset >= data.size()) {
+		return 0;
+	}
+	if (len > data.size()-offset) {
+		len = data.size()-offset;
+	}
+	memcpy(buf, data.data()+offset, len);
+	return (int64_t)len;
+}
+
+// =====================================================================
+// キャッシュへの追加
+// =====================================================================
+
+void
+BlockCache::put(int slice, uint64_t block, const void* data, size_t size)
+{
+	if (size > mShardBudget) {
+		return;
+	}
+	uint64_t key = ((uint64_t)slice<<56) | block;
+	Shard& shard = shardOf(key);
+	std::lock_guard<std::mutex> lock(shard.mMutex);
+	if (shard.mIndex.find(key) != shard.mIndex.end()) {
+		// 他のスレッドが先に追加した
+		return;
+	}
+
+	// 容量を超える分を、最も古く使われたブロックから追い出す
+	while (!shard.mLRU.empty() && (shard.mBytes+size > mShardBudget)) {
+		Block& last = shard.mLRU.back();
+		shard.mBytes -= last.mData.size();
+		shard.mIndex.erase(last.mKey);
+		shard.mLRU.pop_back();
+		mEvictions++;
+	}
+
+	shard.mLRU.emplace_front();
+	Block& b = shard.mLRU.front();
+	b.mKey = key;
+	b.mData.assign((const uint8_t*)data, (const uint8_t*)data+size);
+	shard.mIndex[key] = shard.mLRU.begin();
+	shard.mBytes += size;
+}
+
+// =====================================================================
+// 統計情報
+// =====================================================================
+
+BlockCache::Stats
+BlockCache::stats() const
+{
+	Stats stats = {0};
+	stats.mHits = mHits;
+	stats.mMisses = mMisses;
+	stats.mEvictions = mEvictions;
+	for (int i=0; i<mShards; i++) {
+		Shard& shard = mShard[i];
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		stats.mBytes += shard.mBytes;
+	}
+	return stats;
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
@@ -0,0 +1,92 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: チェックサムの計算
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "GasFs.h"
+
+// XXH3はヘッダのみで取り込む(xxhash/のライセンスはxxhash.hを参照)
+#define XXH_INLINE_ALL
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash/xxhash.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// チェックサムの逐次計算
+// =====================================================================
+
+Checksum::Checksum(ChecksumType type)
+ : mType(type)
+ , mCRC(0)
+ , mState(nullptr)
+{
+	if (mType == CHECKSUM_XXH3) {
+		mState = XXH3_createState();
+	}
+	reset();
+}
+
+Checksum::~Checksum()
+{
+	if (mState != nullptr) {
+		XXH3_freeState((XXH3_state_t*)mState);
+	}
+}
+
+void
+Checksum::reset()
+{
+	mCRC = 0;
+	if (mState != nullptr) {
+		XXH3_64bits_reset((XXH3_state_t*)mState);
+	}
+}
+
+void
+Checksum::update(const uint8_t* buf, size_t bufsiz)
+{
+	if (mState != nullptr) {
+		XXH3_64bits_update((XXH3_state_t*)mState, buf, bufsiz);
+		return;
+	}
+	mCRC = GetCRCParallel(buf, bufsiz, mCRC);
+}
+
+uint64_t
+Checksum::digest() const
+{
+	if (mState != nullptr) {
+		return XXH3_64bits_digest((const XXH3_state_t*)mState);
+	}
+	return mCRC;
+}
+
+// =====================================================================
+// チェックサムの一括計算
+// =====================================================================
+
+uint64_t
+GetChecksum(ChecksumType type, const uint8_t* buf, size_t bufsiz)
+{
+	if (type == CHECKSUM_XXH3) {
+		return XXH3_64bits(buf, bufsiz);
+	}
+	return GetCRCParallel(buf, bufsiz, 0);
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
@@ -0,0 +1,476 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: CRCの計算
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "GasFs.h"
+
+// SIMDで計算できるアーキテクチャ
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GASFS_CRC_X86
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GASFS_CRC_TARGET_X86
+#else
+#include <cpuid.h>
+#define GASFS_CRC_TARGET_X86 __attribute__((target("sse2,pclmul")))
+#endif
+#endif
+
+#if defined(_M_ARM64) || defined(__aarch64__)
+#define GASFS_CRC_ARM
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GASFS_CRC_TARGET_ARM
+#else
+#include <arm_acle.h>
+#define GASFS_CRC_TARGET_ARM __attribute__((target("+crc")))
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+#endif
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// CRCの計算(テーブル)
+// どのCPUでも使える。SIMDの端数もこちらで処理する
+// =====================================================================
+
+// CRCテーブル
+// 関数内staticの初期化はスレッドセーフなので、最初の呼び出しが複数スレッドから
+// 同時に来てもテーブルの作成は1回だけ行われる
+struct CRCTable {
+	// mTable[0]が通常の1バイトずつのテーブル
+	// mTable[k]はmTable[0]の値をさらにkバイト分進めたもの(slice-by-16用)
+	uint32_t mTable[16][256];
+
+	CRCTable() {
+		const uint32_t magic = 0xedb88320;
+		for (int i=0; i<256; i++) {
+			uint32_t t = i;
+			for (int j=0; j<8; j++) {
+				int b = t & 1;
+				t >>= 1;
+				if (b) t^= magic;
+			}
+			mTable[0][i] = t;
+		}
+		for (int k=1; k<16; k++) {
+			for (int i=0; i<256; i++) {
+				uint32_t t = mTable[k-1][i];
+				mTable[k][i] = mTable[0][t & 0xff] ^ (t >> 8);
+			}
+		}
+	}
+};
+
+static const CRCTable&
+getCRCTable()
+{
+	static const CRCTable table;
+	return table;
+}
+
+static inline uint32_t
+load32LE(const uint8_t* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t
+crcTable(const uint8_t* buf, size_t bufsiz, uint32_t crc)
+{
+	const uint32_t (*table)[256] = getCRCTable().mTable;
+
+	// 16バイトずつ、16枚のテーブルを引いてまとめて進める
+	while (bufsiz >= 16) {
+		uint32_t a = load32LE(buf) ^ crc;
+		uint32_t b = load32LE(buf+4);
+		uint32_t c = load32LE(buf+8);
+		uint32_t d = load32LE(buf+12);
+		crc = table[15][a & 0xff] ^ table[14][(a >> 8) & 0xff] ^ table[13][(a >> 16) & 0xff] ^ table[12][a >> 24]
+		    ^ table[11][b & 0xff] ^ table[10][(b >> 8) & 0xff] ^ table[9][(b >> 16) & 0xff] ^ table[8][b >> 24]
+		    ^ table[7][c & 0xff] ^ table[6][(c >> 8) & 0xff] ^ table[5][(c >> 16) & 0xff] ^ table[4][c >> 24]
+		    ^ table[3][d & 0xff] ^ table[2][(d >> 8) & 0xff] ^ table[1][(d >> 16) & 0xff] ^ table[0][d >> 24];
+		buf += 16;
+		bufsiz -= 16;
+	}
+
+	// 残りは1バイトずつ
+	while (bufsiz--) {
+		crc = table[0][(crc ^ *(buf++)) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+// =====================================================================
+// CRCの計算(x86 PCLMULQDQ)
+// 64バイトずつ4本並列に畳み込み、最後にBarrett還元で32ビットにする
+// 定数はChromiumのzlib(crc32_simd.c)と同じもの
+// 長さは64バイト以上で16の倍数であること
+// =====================================================================
+
+#if defined(GASFS_CRC_X86)
+
+GASFS_CRC_TARGET_X86 static uint32_t
+crcPclmul(const uint8_t* buf, size_t len, uint32_t crc)
+{
+	alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_load_si128((const __m128i*)k1k2);
+	buf += 64;
+	len -= 64;
+
+	// 64バイトずつ畳み込む
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	// 4本を128ビットにまとめる
+	x0 = _mm_load_si128((const __m128i*)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// 残りを16バイトずつ畳み込む
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i*)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	// 128ビットから64ビットへ
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett還元で32ビットへ
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static bool
+hasPclmul()
+{
+	int ecx, edx;
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	ecx = info[2];
+	edx = info[3];
+#else
+	unsigned int a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d)) {
+		return false;
+	}
+	ecx = (int)c;
+	edx = (int)d;
+#endif
+	// SSE2とPCLMULQDQ
+	return ((edx & (1 << 26)) != 0) && ((ecx & (1 << 1)) != 0);
+}
+
+#endif
+
+// =====================================================================
+// CRCの計算(ARMv8 CRC32命令)
+// crc32b/crc32dはgasfsと同じ多項式(0xedb88320)なので、そのまま使える
+// 未検証のため、GetCRC()では使わない。GetCRCKernel()で指定したときだけ使う
+// =====================================================================
+
+#if defined(GASFS_CRC_ARM)
+
+GASFS_CRC_TARGET_ARM static uint32_t
+crcArm(const uint8_t* buf, size_t len, uint32_t crc)
+{
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc = __crc32d(crc, v);
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = __crc32b(crc, *(buf++));
+	}
+	return crc;
+}
+
+static bool
+hasArmCRC()
+{
+#if defined(_WINDOWS)
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__APPLE__)
+	return true;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+
+#endif
+
+// =====================================================================
+// CRCの計算
+// 最初の呼び出しでCPUを調べて、使える中でいちばん速い処理を選ぶ
+// =====================================================================
+
+struct CRCKernelInfo {
+	bool mAvailable[CRC_KERNEL_MAX];
+	CRCKernel mBest;
+
+	CRCKernelInfo() {
+		for (int i=0; i<CRC_KERNEL_MAX; i++) {
+			mAvailable[i] = false;
+		}
+		mAvailable[CRC_KERNEL_TABLE] = true;
+#if defined(GASFS_CRC_X86)
+		mAvailable[CRC_KERNEL_PCLMUL] = hasPclmul();
+#endif
+#if defined(GASFS_CRC_ARM)
+		mAvailable[CRC_KERNEL_ARM] = hasArmCRC();
+#endif
+		// ARMの処理は実機でまだ確かめていないので、自動では選ばない
+		// crcbenchで確認できたら、ここで選ぶようにする
+		mBest = CRC_KERNEL_TABLE;
+		if (mAvailable[CRC_KERNEL_PCLMUL]) {
+			mBest = CRC_KERNEL_PCLMUL;
+		}
+	}
+};
+
+static const CRCKernelInfo&
+getCRCKernelInfo()
+{
+	static const CRCKernelInfo info;
+	return info;
+}
+
+bool
+HasCRCKernel(CRCKernel kernel)
+{
+	if ((kernel < 0) || (kernel >= CRC_KERNEL_MAX)) {
+		return false;
+	}
+	return getCRCKernelInfo().mAvailable[kernel];
+}
+
+// 処理を指定して計算する。使えない処理を指定したときはテーブルで計算する
+// crcbenchで各処理を確かめるのにも使う
+uint32_t
+GetCRCKernel(CRCKernel kernel, const uint8_t* buf, size_t bufsiz, uint32_t crc)
+{
+	if (!HasCRCKernel(kernel)) {
+		kernel = CRC_KERNEL_TABLE;
+	}
+	crc ^= 0xffffffff;
+
+	switch (kernel) {
+#if defined(GASFS_CRC_X86)
+	  case CRC_KERNEL_PCLMUL:
+		if (bufsiz >= 64) {
+			size_t len = bufsiz & ~(size_t)15;
+			crc = crcPclmul(buf, len, crc);
+			buf += len;
+			bufsiz -= len;
+		}
+		break;
+#endif
+#if defined(GASFS_CRC_ARM)
+	  case CRC_KERNEL_ARM:
+		crc = crcArm(buf, bufsiz, crc);
+		bufsiz = 0;
+		break;
+#endif
+	  default:
+		break;
+	}
+	crc = crcTable(buf, bufsiz, crc);
+
+	return crc ^ 0xffffffff;
+}
+
+uint32_t
+GetCRC(uint8_t* buf, uint32_t bufsiz, uint32_t crc)
+{
+	static const CRCKernel kernel = getCRCKernelInfo().mBest;
+	return GetCRCKernel(kernel, buf, bufsiz, crc);
+}
+
+// =====================================================================
+// CRCの連結
+// CRC(A)とCRC(B)とBの長さから、CRC(A+B)を求める
+// GF(2)上でCRC(A)にx^(8*lenB)を掛けてCRC(B)と足す(zlibのcrc32_combineと同じ方法)
+// =====================================================================
+
+static const uint32_t CRC_POLY = 0xedb88320;
+
+// a*b mod P (ビット反転表現)
+static uint32_t
+multModP(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+	while (!0) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m-1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? ((b >> 1) ^ CRC_POLY) : (b >> 1);
+	}
+	return p;
+}
+
+// x^(2^k) mod Pのテーブル
+struct CRCPowerTable {
+	uint32_t mTable[64];
+
+	CRCPowerTable() {
+		uint32_t p = (uint32_t)1 << 30;	// x^1
+		mTable[0] = p;
+		for (int k=1; k<64; k++) {
+			p = multModP(p, p);
+			mTable[k] = p;
+		}
+	}
+};
+
+uint32_t
+CombineCRC(uint32_t crcA, uint32_t crcB, uint64_t lenB)
+{
+	static const CRCPowerTable power;
+
+	// x^(8*lenB) mod P
+	uint32_t x = (uint32_t)1 << 31;	// x^0
+	int k = 3;
+	while (lenB) {
+		if (lenB & 1) {
+			x = multModP(power.mTable[k & 63], x);
+		}
+		lenB >>= 1;
+		k++;
+	}
+	return multModP(x, crcA) ^ crcB;
+}
+
+// =====================================================================
+// CRCの並列計算
+// バッファを区間に分けて別々のスレッドで計算し、CombineCRCでつなぐ
+// threadsが0ならCPUの数だけ使う
+// =====================================================================
+
+uint32_t
+GetCRCParallel(const uint8_t* buf, size_t bufsiz, uint32_t crc, int threads)
+{
+	// 1スレッドあたり最低4MBにする。それより小さいとスレッドの起動のほうが高くつく
+	const size_t minRange = 4*1024*1024;
+	if (threads <= 0) {
+		threads = (int)std::thread::hardware_concurrency();
+	}
+	size_t ranges = std::min((size_t)std::max(threads, 1), (bufsiz+minRange-1)/minRange);
+	if ((ranges <= 1) || (bufsiz > 0xffffffffULL*ranges)) {
+		while (bufsiz > 0) {
+			uint32_t len = (uint32_t)std::min(bufsiz, (size_t)0x80000000);
+			crc = GetCRC((uint8_t*)buf, len, crc);
+			buf += len;
+			bufsiz -= len;
+		}
+		return crc;
+	}
+
+	size_t rangeSize = (bufsiz+ranges-1)/ranges;
+	std::vector<uint32_t> crcs(ranges);
+	std::vector<std::thread> workers;
+	for (size_t k=1; k<ranges; k++) {
+		workers.emplace_back([&, k]() {
+			size_t pos = k*rangeSize;
+			crcs[k] = GetCRC((uint8_t*)buf+pos, (uint32_t)(std::min(bufsiz, pos+rangeSize)-pos), 0);
+		});
+	}
+	crcs[0] = GetCRC((uint8_t*)buf, (uint32_t)rangeSize, crc);
+	for (std::thread& t: workers) {
+		t.join();
+	}
+	for (size_t k=1; k<ranges; k++) {
+		size_t pos = k*rangeSize;
+		crcs[0] = CombineCRC(crcs[0], crcs[k], std::min(bufsiz, pos+rangeSize)-pos);
+	}
+	return crcs[0];
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
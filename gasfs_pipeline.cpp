@@ -0,0 +1,259 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: 読み込み・チェックサム・書き込みを重ねて行うコピー
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// 段のスレッド
+// バッファには読み込んだ順に通し番号をつけ、各段は処理し終えた数を数える
+// チェックサムと書き込みはどちらもバッファを読むだけなので、互いを待たない
+// 両方が終わったバッファから、次の読み込みに使う
+// =====================================================================
+
+struct CopyPipeline::Engine {
+	enum {
+		STAGE_READ = 0,
+		STAGE_CHECKSUM,
+		STAGE_WRITE,
+		STAGE_MAX
+	};
+
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::vector<size_t> mLen;	// バッファごとの読めたバイト数
+	const std::vector<uint8_t*>& mBuf;
+	const Stage* mStage[STAGE_MAX];
+	uint64_t mDone[STAGE_MAX];
+	int mBusy;		// 段の関数を実行中のスレッド数
+	bool mFailed;
+	bool mStop;
+	std::thread mThreads[2];
+
+	Engine(const std::vector<uint8_t*>& buf)
+	 : mLen(buf.size()), mBuf(buf), mBusy(0), mFailed(false), mStop(false)
+	{
+		for (int i=0; i<STAGE_MAX; i++) {
+			mStage[i] = nullptr;
+			mDone[i] = 0;
+		}
+		mThreads[0] = std::thread([this]() { worker(STAGE_CHECKSUM); });
+		mThreads[1] = std::thread([this]() { worker(STAGE_WRITE); });
+	}
+
+	~Engine() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		mCond.notify_all();
+		for (std::thread& t: mThreads) {
+			t.join();
+		}
+	}
+
+	void worker(int stage) {
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (!0) {
+			mCond.wait(lock, [&]() { return mStop || (!mFailed && (mDone[stage] < mDone[STAGE_READ])); });
+			if (mStop) {
+				return;
+			}
+			const size_t n = (size_t)(mDone[stage] % mBuf.size());
+			const Stage& func = *mStage[stage];
+			const size_t len = mLen[n];
+			bool ret = true;
+			if (func) {
+				mBusy++;
+				lock.unlock();
+				ret = func(mBuf[n], len);
+				lock.lock();
+				mBusy--;
+			}
+			if (!ret) {
+				mFailed = true;
+			}
+			mDone[stage]++;
+			mCond.notify_all();
+		}
+	}
+
+	// 次に読み込めるバッファを待つ。失敗していたら-1を返す
+	int acquire() {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mCond.wait(lock, [&]() {
+			return mFailed || (mDone[STAGE_READ] - std::min(mDone[STAGE_CHECKSUM], mDone[STAGE_WRITE]) < mBuf.size());
+		});
+		if (mFailed) {
+			return -1;
+		}
+		return (int)(mDone[STAGE_READ] % mBuf.size());
+	}
+
+	void release(int n, size_t len) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mLen[n] = len;
+			mDone[STAGE_READ]++;
+		}
+		mCond.notify_all();
+	}
+
+	void fail() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFailed = true;
+		}
+		mCond.notify_all();
+	}
+
+	void start(const Stage& checksum, const Stage& writer) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStage[STAGE_CHECKSUM] = &checksum;
+		mStage[STAGE_WRITE] = &writer;
+		for (int i=0; i<STAGE_MAX; i++) {
+			mDone[i] = 0;
+		}
+		mFailed = false;
+	}
+
+	// 読み込んだバッファがすべて処理されるのを待つ
+	// 失敗したときは、実行中の段の関数が戻るのを待つ
+	bool finish() {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mCond.wait(lock, [&]() {
+			if (mFailed) {
+				return (mBusy == 0);
+			}
+			return (mDone[STAGE_CHECKSUM] == mDone[STAGE_READ]) && (mDone[STAGE_WRITE] == mDone[STAGE_READ]);
+		});
+		mStage[STAGE_CHECKSUM] = nullptr;
+		mStage[STAGE_WRITE] = nullptr;
+		return !mFailed;
+	}
+};
+
+// =====================================================================
+// コピーの準備
+// バッファは最初にrun()を呼んだときに確保する
+// =====================================================================
+
+CopyPipeline::CopyPipeline(size_t bufSize, int buffers)
+ : mBufSize(bufSize)
+ , mBuffers(std::max(buffers, 2))
+ , mEngine(nullptr)
+{
+}
+
+CopyPipeline::~CopyPipeline()
+{
+	delete mEngine;
+	for (uint8_t* p: mBuf) {
+		my_alignedfree(p);
+	}
+}
+
+bool
+CopyPipeline::allocBuffers()
+{
+	// ページ境界に揃えておく
+	const size_t align = 4096;
+	mBufSize = (mBufSize+align-1) & ~(align-1);
+	for (int i=0; i<mBuffers; i++) {
+		uint8_t* p = (uint8_t*)my_alignedalloc(mBufSize, align);
+		if (p == nullptr) {
+			my_printerr("Failed: Cannot allocate copy buffer(%zu bytes).\n", mBufSize);
+			return false;
+		}
+		mBuf.push_back(p);
+	}
+	return true;
+}
+
+// =====================================================================
+// sizeバイトをコピーし、コピーできたバイト数を返す
+// readerが途中で0を返したら、そこまでで終える。どれかの段が失敗したら-1を返す
+// checksumとwriterは空でもよい
+// =====================================================================
+
+int64_t
+CopyPipeline::run(uint64_t size, const Reader& reader, const Stage& checksum, const Stage& writer)
+{
+	if (size == 0) {
+		return 0;
+	}
+	if (mBuf.empty() && !allocBuffers()) {
+		return -1;
+	}
+
+	// 1つのバッファに収まるときは、その場で順に済ませる
+	uint64_t done = 0;
+	if (size <= mBufSize) {
+		uint8_t* buf = mBuf[0];
+		while (done < size) {
+			int64_t readsize = reader(buf, (size_t)(size-done));
+			if (readsize < 0) {
+				return -1;
+			}
+			if (readsize == 0) {
+				break;
+			}
+			if (checksum && !checksum(buf, (size_t)readsize)) {
+				return -1;
+			}
+			if (writer && !writer(buf, (size_t)readsize)) {
+				return -1;
+			}
+			done += readsize;
+		}
+		return (int64_t)done;
+	}
+
+	// 読み込みはこのスレッドで行い、チェックサムと書き込みはEngineのスレッドに渡す
+	if (mEngine == nullptr) {
+		mEngine = new Engine(mBuf);
+	}
+	mEngine->start(checksum, writer);
+	while (done < size) {
+		int n = mEngine->acquire();
+		if (n < 0) {
+			break;
+		}
+		int64_t readsize = reader(mBuf[n], (size_t)std::min(size-done, (uint64_t)mBufSize));
+		if (readsize < 0) {
+			mEngine->fail();
+			break;
+		}
+		if (readsize == 0) {
+			break;
+		}
+		mEngine->release(n, (size_t)readsize);
+		done += readsize;
+	}
+	if (!mEngine->finish()) {
+		return -1;
+	}
+	return (int64_t)done;
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
@@ -0,0 +1,392 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: 優先度と期限つきの読み込みスケジューラ
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+// =====================================================================
+// スケジューラの準備
+// =====================================================================
+
+ReadScheduler::ReadScheduler(Archive& archive)
+ : mArchive(archive)
+ , mReader(archive)
+ , mChunkSize(0)
+ , mQueueDepth(0)
+ , mBackgroundDepth(0)
+ , mPromoteWindow(std::chrono::milliseconds(50))
+ , mNextTicket(1)
+{
+	for (int p=0; p<PRIORITY_MAX; p++) {
+		mInFlight[p] = 0;
+		mCurrentSlice[p] = 0;
+	}
+}
+
+ReadScheduler::~ReadScheduler()
+{
+	close();
+}
+
+bool
+ReadScheduler::init(unsigned queueDepth, int threads, size_t chunkSize)
+{
+	close();
+	if (!mReader.init(queueDepth, threads)) {
+		return false;
+	}
+	mQueueDepth = queueDepth;
+	mBackgroundDepth = std::max(1U, queueDepth/4);
+	mChunkSize = std::max((size_t)4096, chunkSize);
+	return true;
+}
+
+void
+ReadScheduler::close()
+{
+	// 読み込み中のチャンクはAsyncReaderが完了を待つ
+	mReader.close();
+	std::lock_guard<std::mutex> lock(mMutex);
+	mJobs.clear();
+	mUrgent.clear();
+	mDeadlines.clear();
+	for (int p=0; p<PRIORITY_MAX; p++) {
+		mQueue[p].clear();
+		mCursor[p].clear();
+		mCurrentSlice[p] = 0;
+		mInFlight[p] = 0;
+	}
+	mChunk.clear();
+	mFreeChunk.clear();
+	mFinished.clear();
+}
+
+bool
+ReadScheduler::idle()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mJobs.empty() && mFinished.empty();
+}
+
+// =====================================================================
+// 要求の受付と取り消し
+// =====================================================================
+
+ReadScheduler::Ticket
+ReadScheduler::submit(const std::string& path, uint64_t offset, size_t len, void* buf, Priority priority, Clock::time_point deadline)
+{
+	int n = mArchive.view().find(path);
+	if (n < 0) {
+		return 0;
+	}
+	return submitEntry(n, offset, len, buf, priority, deadline);
+}
+
+ReadScheduler::Ticket
+ReadScheduler::submitEntry(int n, uint64_t offset, size_t len, void* buf, Priority priority, Clock::time_point deadline)
+{
+	const Database::View& view = mArchive.view();
+	if ((n < 0) || (n >= view.entries())) {
+		return 0;
+	}
+	if ((priority < 0) || (priority >= PRIORITY_MAX)) {
+		return 0;
+	}
+
+	// ファイルの末尾で切り詰める
+	uint64_t size = view.size(n);
+	if (offset > size) {
+		offset = size;
+	}
+	if (len > size-offset) {
+		len = (size_t)(size-offset);
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Ticket ticket = mNextTicket++;
+	if (len == 0) {
+		Result r = { ticket, 0, false };
+		mFinished.push_back(r);
+		return ticket;
+	}
+	Job& job = mJobs[ticket];
+	job.mSlice = view.slice(n);
+	job.mOffset = view.offset(n)+offset;
+	job.mLen = len;
+	job.mBuf = (uint8_t*)buf;
+	job.mIssued = 0;
+	job.mDone = len;
+	job.mChunks = 0;
+	job.mPriority = priority;
+	job.mDeadline = deadline;
+	job.mSeq = ticket;
+	job.mError = 0;
+	job.mCanceled = false;
+	enqueue(ticket, job);
+	return ticket;
+}
+
+bool
+ReadScheduler::cancel(Ticket ticket)
+{
+	// 読み込み中のチャンクがあれば、その完了を待ってからRESULT_CANCELEDを返す
+	// それまではバッファを解放してはいけない
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mJobs.find(ticket);
+	if ((it == mJobs.end()) || it->second.mCanceled) {
+		return false;
+	}
+	Job& job = it->second;
+	if (job.mIssued < job.mLen) {
+		dequeue(ticket, job);
+	}
+	job.mCanceled = true;
+	if (job.mChunks == 0) {
+		finish(ticket, job, mFinished);
+	}
+	return true;
+}
+
+// =====================================================================
+// 待ち行列
+// 緊急の要求は期限順(期限がなければ受付順)に並べる
+// それ以外はスライスごとに次に読む位置の順に並べ、エレベータ順に発行する
+// =====================================================================
+
+void
+ReadScheduler::enqueue(Ticket ticket, Job& job)
+{
+	if (job.mPriority == PRIORITY_URGENT) {
+		mUrgent.insert(UrgentKey(job.mDeadline, job.mSeq, ticket));
+		return;
+	}
+	mQueue[job.mPriority][job.mSlice].insert(QueueKey(job.mOffset+job.mIssued, ticket));
+	if (job.mDeadline != Clock::time_point::max()) {
+		mDeadlines.insert(std::make_pair(job.mDeadline, ticket));
+	}
+}
+
+void
+ReadScheduler::dequeue(Ticket ticket, Job& job)
+{
+	if (job.mPriority == PRIORITY_URGENT) {
+		mUrgent.erase(UrgentKey(job.mDeadline, job.mSeq, ticket));
+		return;
+	}
+	auto& queue = mQueue[job.mPriority];
+	auto it = queue.find(job.mSlice);
+	if (it != queue.end()) {
+		it->second.erase(QueueKey(job.mOffset+job.mIssued, ticket));
+		if (it->second.empty()) {
+			queue.erase(it);
+		}
+	}
+	if (job.mDeadline != Clock::time_point::max()) {
+		mDeadlines.erase(std::make_pair(job.mDeadline, ticket));
+	}
+}
+
+void
+ReadScheduler::promote(Clock::time_point now)
+{
+	// 期限が迫った要求を緊急に上げる
+	while (!mDeadlines.empty()) {
+		auto it = mDeadlines.begin();
+		if (it->first > now+mPromoteWindow) {
+			break;
+		}
+		Ticket ticket = it->second;
+		Job& job = mJobs[ticket];
+		dequeue(ticket, job);
+		job.mPriority = PRIORITY_URGENT;
+		enqueue(ticket, job);
+	}
+}
+
+ReadScheduler::Ticket
+ReadScheduler::pick(int priority)
+{
+	if (priority == PRIORITY_URGENT) {
+		return mUrgent.empty() ? 0 : std::get<2>(*mUrgent.begin());
+	}
+
+	// 今のスライスに残りがあれば続け、なければ次のスライスに移る
+	auto& queue = mQueue[priority];
+	if (queue.empty()) {
+		return 0;
+	}
+	auto it = queue.lower_bound(mCurrentSlice[priority]);
+	if (it == queue.end()) {
+		it = queue.begin();
+	}
+	mCurrentSlice[priority] = it->first;
+
+	// スライスの中では最後に発行した位置から先へ進み、末尾まで来たら先頭に戻る
+	const std::set<QueueKey>& keys = it->second;
+	auto k = keys.lower_bound(QueueKey(mCursor[priority][it->first], 0));
+	if (k == keys.end()) {
+		k = keys.begin();
+	}
+	return k->second;
+}
+
+// =====================================================================
+// チャンクの発行
+// バックグラウンドの要求が同時に使えるのはmBackgroundDepthまでで、
+// 残りは後から来る緊急・通常の要求のために空けておく
+// =====================================================================
+
+void
+ReadScheduler::dispatch()
+{
+	Clock::time_point now = Clock::now();
+	promote(now);
+
+	while (mReader.inFlight() < mQueueDepth) {
+		int priority;
+		if (!mUrgent.empty()) {
+			priority = PRIORITY_URGENT;
+		} else if (!mQueue[PRIORITY_NORMAL].empty()) {
+			priority = PRIORITY_NORMAL;
+		} else if (!mQueue[PRIORITY_BACKGROUND].empty() && (mInFlight[PRIORITY_BACKGROUND] < mBackgroundDepth)) {
+			priority = PRIORITY_BACKGROUND;
+		} else {
+			break;
+		}
+		Ticket ticket = pick(priority);
+		Job& job = mJobs[ticket];
+		size_t len = std::min(mChunkSize, job.mLen-job.mIssued);
+		uint32_t id;
+		if (mFreeChunk.empty()) {
+			id = (uint32_t)mChunk.size();
+			mChunk.emplace_back();
+		} else {
+			id = mFreeChunk.back();
+			mFreeChunk.pop_back();
+		}
+		Chunk& chunk = mChunk[id];
+		chunk.mTicket = ticket;
+		chunk.mPos = job.mIssued;
+		chunk.mLen = len;
+		chunk.mPriority = priority;
+
+		dequeue(ticket, job);
+		if (!mReader.submitSlice(job.mSlice, job.mOffset+job.mIssued, len, job.mBuf+job.mIssued, id)) {
+			// スライスが開けないなど。残りは発行せずに失敗で終える
+			mFreeChunk.push_back(id);
+			job.mError = -1;
+			job.mIssued = job.mLen;
+			if (job.mChunks == 0) {
+				finish(ticket, job, mFinished);
+			}
+			continue;
+		}
+		job.mIssued += len;
+		job.mChunks++;
+		mInFlight[priority]++;
+		mCursor[priority][job.mSlice] = job.mOffset+job.mIssued;
+		if (job.mIssued < job.mLen) {
+			enqueue(ticket, job);
+		}
+	}
+	mReader.flush();
+}
+
+void
+ReadScheduler::finish(Ticket ticket, Job& job, std::vector<Result>& results)
+{
+	Result r;
+	r.mTicket = ticket;
+	if (job.mCanceled) {
+		r.mResult = RESULT_CANCELED;
+	} else if (job.mError < 0) {
+		r.mResult = job.mError;
+	} else {
+		r.mResult = (int64_t)job.mDone;
+	}
+	r.mLate = (Clock::now() > job.mDeadline);
+	results.push_back(r);
+	mJobs.erase(ticket);
+}
+
+// =====================================================================
+// 発行と完了の受け取り
+// waitがtrueなら、完了した要求が1つもないときに読み込みの完了を待つ
+// 返したResultの要求のバッファは、もうスケジューラから触られない
+// =====================================================================
+
+int
+ReadScheduler::pump(std::vector<Result>& results, bool wait)
+{
+	size_t first = results.size();
+	std::unique_lock<std::mutex> lock(mMutex);
+	dispatch();
+	bool block = wait && mFinished.empty() && (mReader.inFlight() > 0);
+	lock.unlock();
+
+	mCompletions.clear();
+	mReader.reap(mCompletions, block ? 1 : 0);
+
+	lock.lock();
+	for (const AsyncReader::Completion& c: mCompletions) {
+		const Chunk chunk = mChunk[(size_t)c.mUserData];
+		mFreeChunk.push_back((uint32_t)c.mUserData);
+		mInFlight[chunk.mPriority]--;
+		auto it = mJobs.find(chunk.mTicket);
+		if (it == mJobs.end()) {
+			continue;
+		}
+		Ticket ticket = chunk.mTicket;
+		Job& job = it->second;
+		job.mChunks--;
+		if (c.mResult < 0) {
+			if (job.mError == 0) {
+				job.mError = c.mResult;
+			}
+		} else if ((size_t)c.mResult < chunk.mLen) {
+			// AsyncReaderが短く返すのはスライスの終わりに達したときだけなので、読み直しても増えない
+			// 先頭から続けて読めた所までを結果とし、その先はもう発行しない
+			job.mDone = std::min(job.mDone, chunk.mPos+(size_t)c.mResult);
+			if (!job.mCanceled && (job.mIssued < job.mLen)) {
+				dequeue(ticket, job);
+				job.mIssued = job.mLen;
+			}
+		}
+		if ((job.mChunks == 0) && (job.mCanceled || (job.mIssued == job.mLen))) {
+			// チャンクごとのCRCの確認を有効にしていれば、読めた範囲を確認する
+			if (!job.mCanceled && (job.mError == 0) && mArchive.verifyingChunks()) {
+				if (!mArchive.verifyRange(job.mSlice, job.mOffset, job.mDone, job.mBuf)) {
+					job.mError = -1;
+				}
+			}
+			finish(ticket, job, mFinished);
+		}
+	}
+
+	// 空いた分を埋めておく
+	dispatch();
+	results.insert(results.end(), mFinished.begin(), mFinished.end());
+	mFinished.clear();
+	return (int)(results.size()-first);
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
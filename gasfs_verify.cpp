@@ -0,0 +1,173 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// gasfs: 確認済みスライスのキャッシュ
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "GasFs.h"
+
+namespace GasFs {
+
+// -------------------------------------------------------------
+
+static inline void
+setLE(uint8_t* p, uint64_t v, int bytes)
+{
+	for (int i=0; i<bytes; i++) {
+		p[i] = (uint8_t)(v >> (i*8));
+	}
+}
+
+// =====================================================================
+// キャッシュファイルの読み込み
+// ファイルは"gFV3"に続いて64バイトのレコードが古い順に並んだもの
+// =====================================================================
+
+VerifyCache::VerifyCache()
+{
+}
+
+VerifyCache::~VerifyCache()
+{
+}
+
+bool
+VerifyCache::readRecords(const std::string& filename, std::vector<Record>& records)
+{
+	records.clear();
+	FILE* fin = fopen(filename.c_str(), "rb");
+	if (fin == nullptr) {
+		return false;
+	}
+	char mark[4];
+	if ((fread(mark, 1, 4, fin) != 4) || memcmp(mark, GASFS_VERIFYMARK, 4)) {
+		fclose(fin);
+		return false;
+	}
+	Record r;
+	while (fread(&r, 1, sizeof(r), fin) == sizeof(r)) {
+		records.push_back(r);
+	}
+	fclose(fin);
+	return true;
+}
+
+bool
+VerifyCache::load(const std::string& filename)
+{
+	// ファイルがなければ空のキャッシュとして始める
+	mFilename = filename;
+	mAdded.clear();
+	readRecords(mFilename, mRecords);
+	return true;
+}
+
+// =====================================================================
+// キャッシュファイルの保存
+// 他のプロセスが保存した分を読み直してから追記し、一時ファイルを置き換える
+// =====================================================================
+
+bool
+VerifyCache::save()
+{
+	if (mFilename.empty() || mAdded.empty()) {
+		return true;
+	}
+	std::vector<Record> records;
+	readRecords(mFilename, records);
+	for (const Record& a: mAdded) {
+		bool found = false;
+		for (const Record& r: records) {
+			if (!memcmp(&r, &a, sizeof(r))) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			records.push_back(a);
+		}
+	}
+	if (records.size() > MAX_RECORDS) {
+		records.erase(records.begin(), records.end()-MAX_RECORDS);
+	}
+
+	std::string tmpname = mFilename + ".tmp" + std::to_string(my_getpid());
+	FILE* fout = fopen(tmpname.c_str(), "wb");
+	if (fout == nullptr) {
+		my_printerr("Failed: Cannot write [%s].\n", tmpname.c_str());
+		return false;
+	}
+	bool ok = (fwrite(GASFS_VERIFYMARK, 1, 4, fout) == 4);
+	if (ok && !records.empty()) {
+		ok = (fwrite(records.data(), sizeof(Record), records.size(), fout) == records.size());
+	}
+	if (fclose(fout)) {
+		ok = false;
+	}
+	if (!ok || my_rename(tmpname.c_str(), mFilename.c_str())) {
+		my_printerr("Failed: Cannot write [%s].\n", mFilename.c_str());
+		remove(tmpname.c_str());
+		return false;
+	}
+	mRecords.swap(records);
+	mAdded.clear();
+	return true;
+}
+
+// =====================================================================
+// 確認済みかどうか
+// =====================================================================
+
+bool
+VerifyCache::makeRecord(intptr_t fd, const Database::SubHeader& subheader, Record& record)
+{
+	MY_FILEID id;
+	if (my_fileid(fd, &id) < 0) {
+		return false;
+	}
+	memcpy(record.mSubHeader, &subheader, sizeof(record.mSubHeader));
+	setLE(record.mSize, id.mSize, 8);
+	setLE(record.mMTime, id.mMTime, 8);
+	setLE(record.mDev, id.mDev, 8);
+	setLE(record.mInode, id.mInode, 8);
+	return true;
+}
+
+bool
+VerifyCache::isVerified(intptr_t fd, const Database::SubHeader& subheader) const
+{
+	Record record;
+	if (!makeRecord(fd, subheader, record)) {
+		return false;
+	}
+	for (const std::vector<Record>* v: { &mRecords, &mAdded }) {
+		for (const Record& r: *v) {
+			if (!memcmp(&r, &record, sizeof(r))) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void
+VerifyCache::setVerified(intptr_t fd, const Database::SubHeader& subheader)
+{
+	Record record;
+	if (makeRecord(fd, subheader, record) && !isVerified(fd, subheader)) {
+		mAdded.push_back(record);
+	}
+}
+
+// =====================================================================
+
+};
+
+// =====================================================================
+// [EOF]
@@ -14,6 +14,11 @@
 #include <time.h>
 #include <dirent.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "IniFile.h"
 #include "WStrUtil.h"
 #include "GasFs.h"
@@ -21,6 +26,7 @@
 // -------------------------------------------------------------
 
 bool gVerbose;
+std::mutex gTimeMutex;	// gmtime()の結果は共有されるので、使う間はロックする
 
 
 // =====================================================================
@@ -39,8 +45,13 @@ void showHelp()
 	   "  --basedir [dir]       Set base directory of input files.\n"
 	   "                        Not effect to input.gfi and output.\n"
 	   "  --list [list.gfi]     Output list file.\n"
+	   "  --manifest [file]     Remember input files in [file] and do not re-read\n"
+	   "                        unchanged ones when updating slices.\n"
 	   "  --verbose             Output verbose log.\n"
 	   "  --force               Force (ignore file modified time) make file system.\n"
+	   "  --jobs [num]          Make [num] slices in parallel. Default is 1.\n"
+	   "  --devjobs [num]       Make at most [num] slices in parallel on the same device.\n"
+	   "                        Default is same as --jobs.\n"
 	   "  --help                Show this.\n"
 	);
 }
@@ -122,6 +133,7 @@ addPathToMap(GasFs::Global& global, GasFs::Map& map, int depth, int slice, const
 			entry.mOffset = offset;
 			entry.mSize = filesize;
 			entry.mLastModifiedTime = lastmodifiedtime;
+			entry.mCRC = 0;
 			map.insert(std::make_pair(newpath, entry));
 
 			if (gVerbose) {
@@ -135,10 +147,11 @@ addPathToMap(GasFs::Global& global, GasFs::Map& map, int depth, int slice, const
 
 // =====================================================================
 // 入力パスマップからスライスマップの情報を埋める
+// 前回のデータベースにあったファイルは、なるべく前回と同じスライスに入れる
 // =====================================================================
 
 bool
-FillSliceMapInfoFromInputPathMap(GasFs::Global& global, GasFs::Map& mapSlice, GasFs::Map& mapInputPath)
+FillSliceMapInfoFromInputPathMap(GasFs::Global& global, GasFs::Map& mapSlice, GasFs::Map& mapInputPath, const GasFs::Map& mapOldSlice)
 {
 	int slices = global.mSlices;
 	int maxSliceSize = global.mMaxSliceSize;
@@ -206,50 +219,106 @@ FillSliceMapInfoFromInputPathMap(GasFs::Global& global, GasFs::Map& mapSlice, Ga
 		printf("\nAdd Free %d files to rest Slice...\n", mapInputPath.size());
 	}
 
-	// 入力パスマップを列挙してスライスマップへ情報を移す
-	int toslice = 1;
-	for (auto& e: mapInputPath) {
-		const std::string& pathInput = e.first;
-		GasFs::Entry& entryInput = e.second;
-
-		// ファイル容量分の空きがあるスライスを探す
+	// スライスの情報を更新して、スライスマップに追加する
+	auto addFreeFile = [&](const std::string& pathInput, const GasFs::Entry& entryInput, int toslice) {
 		int64_t filesize = (int64_t)entryInput.mSize;
-		int i;
-		for (i=0; i<slices; i++) {
-			if (global.mSlice[toslice].mRest >= filesize) {
-				if (!global.mSlice[toslice].mNoAddFreeFile) {
-					// 空いてて追加禁止属性のないスライスを見つけた
-					break;
-				}
-			}
-			toslice++;
-			if (toslice > slices) {
-				toslice = 1;
-			}
-		}
-		if (i >= slices) {
-			fprintf(stderr, "Failed: Not enough slices (%d) at file [%s]", slices, pathInput.c_str());
-			return false;
-		}
-
-		// スライスの情報を更新
 		global.mSlice[toslice].mFiles++;
 		global.mSlice[toslice].mRest -= filesize;
 		if (global.mSlice[toslice].mLastModifiedTime < entryInput.mLastModifiedTime) {
 			global.mSlice[toslice].mLastModifiedTime = entryInput.mLastModifiedTime;
 		}
 
-		// スライスマップに追加
 		GasFs::Entry entry;
 		entry.mSlice = toslice;
 		entry.mOffset = 0;
 		entry.mSize = (uint64_t)filesize;
 		entry.mLastModifiedTime = entryInput.mLastModifiedTime;
+		entry.mCRC = 0;
 		mapSlice.insert(std::make_pair(pathInput, entry));
+	};
+
+	// 残りのファイルを、空きのあるスライスに順に入れる
+	// 入らないファイルがあれば、そのパスをfailedPathに返す
+	auto addFreeFiles = [&](const GasFs::Map& mapFree, std::string& failedPath) {
+		int toslice = 1;
+		for (auto& e: mapFree) {
+			const std::string& pathInput = e.first;
+			const GasFs::Entry& entryInput = e.second;
+
+			// ファイル容量分の空きがあるスライスを探す
+			int64_t filesize = (int64_t)entryInput.mSize;
+			int i;
+			for (i=0; i<slices; i++) {
+				if (global.mSlice[toslice].mRest >= filesize) {
+					if (!global.mSlice[toslice].mNoAddFreeFile) {
+						// 空いてて追加禁止属性のないスライスを見つけた
+						break;
+					}
+				}
+				toslice++;
+				if (toslice > slices) {
+					toslice = 1;
+				}
+			}
+			if (i >= slices) {
+				failedPath = pathInput;
+				return false;
+			}
+
+			// スライスの情報を更新してスライスマップに追加
+			addFreeFile(pathInput, entryInput, toslice);
+
+			if (gVerbose) {
+				printf(" to Slice %03d [%4" PRIi64 "MB]: %s\n", toslice, global.mSlice[toslice].mRest/1024/1024, pathInput.c_str());
+			}
+		}
+		return true;
+	};
+
+	// 前回と同じスライスに入れる前の状態を取っておく
+	const std::vector<GasFs::Slice> sliceBefore = global.mSlice;
+	const GasFs::Map mapSliceBefore = mapSlice;
+	const GasFs::Map mapInputPathBefore = mapInputPath;
+
+	// 前回のデータベースにあったファイルは、空きがあれば前回と同じスライスに入れる
+	// ファイルのスライスが変わるとそのスライスを作り直すことになるので、なるべく動かさない
+	int kept = 0;
+	for (GasFs::Map::iterator it = mapInputPath.begin(); it != mapInputPath.end(); ) {
+		const std::string& pathInput = it->first;
+		GasFs::Map::const_iterator itOld = mapOldSlice.find(pathInput);
+		if (itOld != mapOldSlice.end()) {
+			int toslice = itOld->second.mSlice;
+			if ((toslice >= 1) && (toslice <= slices) && !global.mSlice[toslice].mNoAddFreeFile
+			 && (global.mSlice[toslice].mRest >= (int64_t)it->second.mSize)) {
+				addFreeFile(pathInput, it->second, toslice);
+				if (gVerbose) {
+					printf(" keep Slice %03d [%4" PRIi64 "MB]: %s\n", toslice, global.mSlice[toslice].mRest/1024/1024, pathInput.c_str());
+				}
+				it = mapInputPath.erase(it);
+				kept++;
+				continue;
+			}
+		}
+		it++;
+	}
 
+	// 残りのファイルを入れる
+	// 前回と同じスライスに入れたために空きが細切れになって入らないときは、
+	// 前回のスライスを考えずに、すべてのファイルを最初から順に入れ直す
+	std::string failedPath;
+	bool added = addFreeFiles(mapInputPath, failedPath);
+	if (!added && (kept > 0)) {
 		if (gVerbose) {
-			printf(" to Slice %03d [%4" PRIi64 "MB]: %s\n", toslice, global.mSlice[toslice].mRest/1024/1024, pathInput.c_str());
+			printf("\nRetry adding Free %d files without keeping previous Slice...\n", mapInputPathBefore.size());
 		}
+		global.mSlice = sliceBefore;
+		mapSlice = mapSliceBefore;
+		mapInputPath = mapInputPathBefore;
+		added = addFreeFiles(mapInputPath, failedPath);
+	}
+	if (!added) {
+		fprintf(stderr, "Failed: Not enough slices (%d) at file [%s]", slices, failedPath.c_str());
+		return false;
 	}
 
 	if (gVerbose) {
@@ -263,248 +332,825 @@ FillSliceMapInfoFromInputPathMap(GasFs::Global& global, GasFs::Map& mapSlice, Ga
 }
 
 // =====================================================================
-// スライスマップからスライスファイルを作成する
+// 入力ファイルの記録(マニフェスト)
+// 前回作成したときの入力ファイルのサイズ・更新時刻・デバイス・inodeとCRCと、
+// 書き終えたスライスファイルのサイズ・更新時刻・デバイス・inodeを記録する
+// 1行に1つずつ、
+// 「S スライス番号 サイズ 更新時刻 デバイス inode」
+// 「F サイズ 更新時刻 デバイス inode CRC パス名」
+// を記録する
 // =====================================================================
 
+struct Manifest {
+	struct Source {
+		GasFs::MY_FILEID mId;
+		uint32_t mCRC;
+	};
+	std::map<std::string, Source> mSources;
+	std::map<int, GasFs::MY_FILEID> mSlices;
+	std::mutex mMutex;	// スライスを並行して作るときに使う
+};
+
+bool
+isSameFileId(const GasFs::MY_FILEID& a, const GasFs::MY_FILEID& b)
+{
+	return (a.mSize == b.mSize) && (a.mMTime == b.mMTime) && (a.mDev == b.mDev) && (a.mInode == b.mInode);
+}
+
+bool
+getFileId(const std::string& path, GasFs::MY_FILEID& id)
+{
+	GasFs::MY_FD fd = GasFs::my_open(path.c_str());
+	if (fd < 0) {
+		return false;
+	}
+	int ret = GasFs::my_fileid(fd, &id);
+	GasFs::my_close(fd);
+	return (ret == 0);
+}
+
+bool
+loadManifest(const std::string& filename, Manifest& manifest)
+{
+	FILE* fin = fopen(filename.c_str(), "r");
+	if (fin == nullptr) {
+		// まだ記録がない
+		return true;
+	}
+	char line[_MAX_PATH+256];
+	while (fgets(line, sizeof(line), fin) != nullptr) {
+		GasFs::MY_FILEID id = {0};
+		if (line[0] == 'S') {
+			int slice = 0;
+			int n = sscanf(line, "S %d %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64, &slice, &id.mSize, &id.mMTime, &id.mDev, &id.mInode);
+			if (n == 5) {
+				manifest.mSlices[slice] = id;
+			}
+			continue;
+		}
+		if (line[0] != 'F') {
+			continue;
+		}
+		uint32_t crc = 0;
+		int pathofs = 0;
+		int n = sscanf(line, "F %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNx32 " %n", &id.mSize, &id.mMTime, &id.mDev, &id.mInode, &crc, &pathofs);
+		if ((n != 5) || (pathofs == 0)) {
+			continue;
+		}
+		std::string path(line+pathofs);
+		while (!path.empty() && ((path.back() == '\n') || (path.back() == '\r'))) {
+			path.pop_back();
+		}
+		if (!path.empty()) {
+			Manifest::Source& source = manifest.mSources[path];
+			source.mId = id;
+			source.mCRC = crc;
+		}
+	}
+	fclose(fin);
+	return true;
+}
+
 bool
-MakeSliceFileFromSliceMap(GasFs::Global& global, GasFs::Map& mapSlice)
+saveManifest(const std::string& filename, const Manifest& manifest)
+{
+	// 書きかけのファイルを残さないよう、別名で書いてから置き換える
+	std::string tmpname = filename + ".tmp" + std::to_string(GasFs::my_getpid());
+	FILE* fout = fopen(tmpname.c_str(), "w");
+	if (fout == nullptr) {
+		fprintf(stderr, "Failed: Cannot write [%s].\n", tmpname.c_str());
+		return false;
+	}
+	bool ok = true;
+	for (const auto& e: manifest.mSlices) {
+		const GasFs::MY_FILEID& id = e.second;
+		if (fprintf(fout, "S %d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", e.first, id.mSize, id.mMTime, id.mDev, id.mInode) < 0) {
+			ok = false;
+		}
+	}
+	for (const auto& e: manifest.mSources) {
+		const GasFs::MY_FILEID& id = e.second.mId;
+		if (fprintf(fout, "F %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %08x %s\n", id.mSize, id.mMTime, id.mDev, id.mInode, e.second.mCRC, e.first.c_str()) < 0) {
+			ok = false;
+		}
+	}
+	if (fclose(fout)) {
+		ok = false;
+	}
+	if (!ok || GasFs::my_rename(tmpname.c_str(), filename.c_str())) {
+		fprintf(stderr, "Failed: Cannot write [%s].\n", filename.c_str());
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
+
+// =====================================================================
+// 前回のデータベースと比べて、作り直しが必要なスライスに印をつける
+// ファイルが増えた・減った・他のスライスと入れ替わった・サイズが変わった
+// スライスが対象。それ以外のスライスは、スライスファイルと収録する
+// ファイルの更新時刻で作り直すかどうかを決める
+// 印をつけたスライスの数を返す
+// =====================================================================
+
+int
+MarkDirtySlices(GasFs::Global& global, GasFs::Map& mapSlice, const GasFs::Map& mapOldSlice)
 {
 	int slices = global.mSlices;
-	int maxSliceSize = global.mMaxSliceSize;
-	const std::string& sliceFilename = global.mSliceFilename;
+	for (int i=1; i<=slices; i++) {
+		global.mSlice[i].mDirty = false;
+	}
+	auto mark = [&](int slice, const char* reason, const std::string& path) {
+		if ((slice < 1) || (slice > slices)) {
+			return;
+		}
+		if (gVerbose && !global.mSlice[slice].mDirty) {
+			printf("Slice %03d is different: %s [%s]\n", slice, reason, path.c_str());
+		}
+		global.mSlice[slice].mDirty = true;
+	};
+
+	// どちらのマップもパス名順なので、並べて突き合わせる
+	GasFs::Map::iterator it1 = mapSlice.begin();
+	GasFs::Map::const_iterator it2 = mapOldSlice.begin();
+	while ((it1 != mapSlice.end()) || (it2 != mapOldSlice.end())) {
+		if ((it2 == mapOldSlice.end()) || ((it1 != mapSlice.end()) && (it1->first < it2->first))) {
+			mark(it1->second.mSlice, "new File", it1->first);
+			it1++;
+			continue;
+		}
+		if ((it1 == mapSlice.end()) || (it2->first < it1->first)) {
+			mark(it2->second.mSlice, "removed File", it2->first);
+			it2++;
+			continue;
+		}
+		const std::string& path = it1->first;
+		GasFs::Entry& entry1 = it1->second;
+		const GasFs::Entry& entry2 = it2->second;
+		if (entry1.mSlice != entry2.mSlice) {
+			mark(entry1.mSlice, "moved in File", path);
+			mark(entry2.mSlice, "moved out File", path);
+		} else if (entry1.mSize != entry2.mSize) {
+			mark(entry1.mSlice, "resized File", path);
+		} else {
+			// スライスを作り直さない場合に備えて、ファイルのCRCを引き継ぐ
+			entry1.mCRC = entry2.mCRC;
+		}
+		it1++;
+		it2++;
+	}
 
+	int dirty = 0;
 	for (int i=1; i<=slices; i++) {
-		uint32_t crc = 0;
-		int64_t totalSize = 0;
-		bool skip = false;
+		if (global.mSlice[i].mDirty) {
+			dirty++;
+		}
+	}
+	return dirty;
+}
 
-		// スライスのファイル名を決定
-		char slicePath[_MAX_PATH];
-		sprintf(slicePath, "%s_%03d.gfs", sliceFilename.c_str(), i);
-		if (gVerbose) {
-			printf("Output Slice %03d file [%s] ... ", i, slicePath);
+// =====================================================================
+// 使い回すスライスの内容を、前回のチャンクCRCで確かめる
+// rangesはスライス内の使い回す範囲。そのうちスライスから読み直すことになる
+// チャンクを丸ごと読んで確かめる。CRC32では範囲に丸ごと含まれないチャンクだけ、
+// XXH3ではチャンクCRCをつなげないので範囲にかかるすべてのチャンクを読む
+// =====================================================================
+
+bool
+CheckReuseChunks(const char* slicePath, const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const std::vector<uint32_t>& oldChunkCRC, GasFs::ChecksumType type)
+{
+	const uint64_t chunkSize = GASFS_CHUNK_SIZE;
+	std::vector<uint64_t> chunks;
+	for (const auto& r: ranges) {
+		if (r.second <= r.first) {
+			continue;
+		}
+		for (uint64_t k=r.first/chunkSize; k<=(r.second-1)/chunkSize; k++) {
+			bool whole = (k*chunkSize >= r.first) && ((k+1)*chunkSize <= r.second);
+			if ((type == GasFs::CHECKSUM_XXH3) || !whole) {
+				chunks.push_back(k);
+			}
 		}
+	}
+	if (chunks.empty()) {
+		return true;
+	}
 
-		// スライスの更新確認
-		uint64_t lastmodifiedtime = 0;
-		struct _stat s;
-		int st = _stat(slicePath, &s);
-		if (st == 0) {
-			lastmodifiedtime = s.st_mtime;
+	GasFs::MY_FD fd = GasFs::my_open(slicePath);
+	if (fd < 0) {
+		return false;
+	}
+	const uint64_t header = sizeof(GasFs::Database::SubHeader);
+	const int64_t filesize = GasFs::my_filesize(fd);
+	const uint64_t datasize = (filesize > (int64_t)header) ? (uint64_t)filesize-header : 0;
+	std::vector<uint8_t> buf((size_t)chunkSize);
+	bool ok = true;
+	for (uint64_t k: chunks) {
+		if ((k >= oldChunkCRC.size()) || (k*chunkSize >= datasize)) {
+			ok = false;
+			break;
 		}
-		if (!global.mForce) {
-			if (st == 0) {
-				// スライスに入れるファイル全部の最終更新時刻がスライスより古いときはスキップ
-				if (lastmodifiedtime > global.mSlice[i].mLastModifiedTime) {
-					if (gVerbose) {
-						printf("Skip modifying [%s]: Slice time(%" PRIu64 ") > Files time(%" PRIu64 ").\n", slicePath, lastmodifiedtime, global.mSlice[i].mLastModifiedTime);
-					}
-					skip = true;
-				} else {
-					if (gVerbose) {
-						printf("modifying [%s]: Slice time(%" PRIu64 ") <= Files time(%" PRIu64 ")... ", slicePath, lastmodifiedtime, global.mSlice[i].mLastModifiedTime);
-					}
+		size_t len = (size_t)std::min(chunkSize, datasize-k*chunkSize);
+		if ((GasFs::my_pread(fd, buf.data(), len, header+k*chunkSize) != (int64_t)len)
+		 || ((uint32_t)GasFs::GetChecksum(type, buf.data(), len) != oldChunkCRC[(size_t)k])) {
+			ok = false;
+			break;
+		}
+	}
+	GasFs::my_close(fd);
+	return ok;
+}
+
+// =====================================================================
+// スライスマップからスライスファイルを1つ作成する
+// 複数のスレッドから別々のスライスについて呼ばれる
+// マニフェストがあれば、変わっていない入力ファイルのうちスライス内の位置も
+// 前回と同じものは、読み書きせずにスライスに残っている内容をそのまま使う
+// =====================================================================
+
+bool
+MakeSliceFile(GasFs::Global& global, GasFs::Map& mapSlice, const GasFs::Map& mapOldSlice, const Manifest* oldManifest, Manifest* newManifest, int i, uint64_t& sliceModifiedTime)
+{
+	const std::string& sliceFilename = global.mSliceFilename;
+	const bool xxh3 = (global.mChecksum == GasFs::CHECKSUM_XXH3);
+
+	uint64_t crc = 0;
+	int64_t totalSize = 0;
+	bool skip = false;
+	std::vector<uint32_t> chunkCRC;
+	uint32_t chunkcrc = 0;
+	uint64_t chunkFill = 0;
+	GasFs::Checksum sliceSum(global.mChecksum);
+	GasFs::Checksum chunkSum(global.mChecksum);
+
+	// スライスのファイル名を決定
+	char slicePath[_MAX_PATH];
+	sprintf(slicePath, "%s_%03d.gfs", sliceFilename.c_str(), i);
+	if (gVerbose) {
+		printf("Output Slice %03d file [%s] ... ", i, slicePath);
+	}
+
+	// スライスの更新確認
+	uint64_t lastmodifiedtime = 0;
+	struct _stat s;
+	int st = _stat(slicePath, &s);
+	if (st == 0) {
+		lastmodifiedtime = s.st_mtime;
+	}
+	if (!global.mForce && !global.mSlice[i].mDirty) {
+		if (st == 0) {
+			// スライスに入れるファイル全部の最終更新時刻がスライスより古いときはスキップ
+			if (lastmodifiedtime > global.mSlice[i].mLastModifiedTime) {
+				if (gVerbose) {
+					printf("Skip modifying [%s]: Slice time(%" PRIu64 ") > Files time(%" PRIu64 ").\n", slicePath, lastmodifiedtime, global.mSlice[i].mLastModifiedTime);
 				}
+				skip = true;
 			} else {
 				if (gVerbose) {
-					printf("creating [%s] ... ", slicePath);
+					printf("modifying [%s]: Slice time(%" PRIu64 ") <= Files time(%" PRIu64 ")... ", slicePath, lastmodifiedtime, global.mSlice[i].mLastModifiedTime);
 				}
 			}
 		} else {
 			if (gVerbose) {
-				printf("creating [%s]: by --force option ... ", slicePath);
+				printf("creating [%s] ... ", slicePath);
 			}
 		}
+	} else if (!global.mForce) {
+		if (gVerbose) {
+			printf("creating [%s]: files are different ... ", slicePath);
+		}
+	} else {
+		if (gVerbose) {
+			printf("creating [%s]: by --force option ... ", slicePath);
+		}
+	}
 
-		// スライスサブヘッダが同一か確認
-		if (skip) {
-			GasFs::Database::SubHeader b = {0};
-			if (gVerbose) {
-				printf("Check Slice SubHeader [%s]\n", slicePath);
-			}
-			skip = false;
-			FILE *fin = fopen(slicePath, "rb");
-			if (fin != nullptr) {
-				fread(&b, 1, sizeof(b), fin);
-				fclose(fin);
-				if (!memcmp(&(b.mMark[0]), GASFS_SUBMARK, 4)) {
-					if (gVerbose) {
-						printf("Skip modifying [%s]: Slice SubHeader OK.\n", slicePath);
-					}
-					skip = true;
-
-					global.mSlice[i].mFiles = (b.mFiles[0]<<0) | (b.mFiles[1]<<8) | (b.mFiles[2]<<16);
-					global.mSlice[i].mTotalSize = (b.mTotalSize[0]<<0) | (b.mTotalSize[1]<<8) | (b.mTotalSize[2]<<16) | (b.mTotalSize[3]<<24);
-					global.mSlice[i].mCRC = (b.mCRC[0]<<0) | (b.mCRC[1]<<8) | (b.mCRC[2]<<16) | (b.mCRC[3]<<24);
-					struct tm lt;
-					lt.tm_year = ((b.mDate[0]>>4)*1000)+((b.mDate[0]&0x0f)*100)+((b.mDate[1]>>4)*10)+((b.mDate[1]&0x0f)*1) - 1900;
-					lt.tm_mon = ((b.mDate[2]>>4)*10)+((b.mDate[2]&0x0f)*1) - 1;
-					lt.tm_mday = ((b.mDate[3]>>4)*10)+((b.mDate[3]&0x0f)*1);
-					lt.tm_hour = ((b.mDate[4]>>4)*10)+((b.mDate[4]&0x0f)*1);
-					lt.tm_min = ((b.mDate[5]>>4)*10)+((b.mDate[5]&0x0f)*1);
-					lt.tm_sec = ((b.mDate[6]>>4)*10)+((b.mDate[6]&0x0f)*1);
-					global.mSlice[i].mLastModifiedTime = (uint64_t)_mkgmtime(&lt);
+	// スライスサブヘッダが同一か確認
+	if (skip) {
+		GasFs::Database::SubHeader b = {0};
+		if (gVerbose) {
+			printf("Check Slice SubHeader [%s]\n", slicePath);
+		}
+		skip = false;
+		FILE *fin = fopen(slicePath, "rb");
+		if (fin != nullptr) {
+			fread(&b, 1, sizeof(b), fin);
+			fclose(fin);
+			if (!memcmp(&(b.mMark[0]), GASFS_SUBMARK, 4)) {
+				if (gVerbose) {
+					printf("Skip modifying [%s]: Slice SubHeader OK.\n", slicePath);
 				}
+				skip = true;
+
+				global.mSlice[i].mFiles = (b.mFiles[0]<<0) | (b.mFiles[1]<<8) | (b.mFiles[2]<<16);
+				global.mSlice[i].mTotalSize = (b.mTotalSize[0]<<0) | (b.mTotalSize[1]<<8) | (b.mTotalSize[2]<<16) | (b.mTotalSize[3]<<24);
+				global.mSlice[i].mCRC = (uint32_t)((b.mCRC[0]<<0) | (b.mCRC[1]<<8) | (b.mCRC[2]<<16) | (b.mCRC[3]<<24));
+				global.mSlice[i].mCRC |= (uint64_t)(uint32_t)((b.mCRCHigh[0]<<0) | (b.mCRCHigh[1]<<8) | (b.mCRCHigh[2]<<16) | (b.mCRCHigh[3]<<24)) << 32;
+				struct tm lt;
+				lt.tm_year = ((b.mDate[0]>>4)*1000)+((b.mDate[0]&0x0f)*100)+((b.mDate[1]>>4)*10)+((b.mDate[1]&0x0f)*1) - 1900;
+				lt.tm_mon = ((b.mDate[2]>>4)*10)+((b.mDate[2]&0x0f)*1) - 1;
+				lt.tm_mday = ((b.mDate[3]>>4)*10)+((b.mDate[3]&0x0f)*1);
+				lt.tm_hour = ((b.mDate[4]>>4)*10)+((b.mDate[4]&0x0f)*1);
+				lt.tm_min = ((b.mDate[5]>>4)*10)+((b.mDate[5]&0x0f)*1);
+				lt.tm_sec = ((b.mDate[6]>>4)*10)+((b.mDate[6]&0x0f)*1);
+				global.mSlice[i].mLastModifiedTime = (uint64_t)_mkgmtime(&lt);
 			}
 		}
+	}
 
-		// スライスを開く
-		FILE *fout = nullptr;
-		if (!skip) {
-			fout = fopen(slicePath, "wb");
-			if (fout == nullptr) {
-				fprintf(stderr, "Failed: Cannot open slice [%s].\n", slicePath);
-				return false;
-			}
-
-			// サブヘッダの分を書く
-			GasFs::Database::SubHeader b = {0};
-			size_t wrotesize = fwrite(&b, 1, sizeof(b), fout);
-			if (wrotesize != sizeof(b)) {
-				fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
-				return false;
-			}
-		}
+	// スライスをその場で更新できるか確認
+	// マニフェストに記録したときからスライスファイルが変わっていなければ、
+	// 前回のデータベースのとおりにファイルが並んでいる
+	bool update = false;
+	GasFs::MY_FILEID sliceId = {0};
+	if (!skip && !global.mForce && (oldManifest != nullptr) && getFileId(slicePath, sliceId)) {
+		auto it = oldManifest->mSlices.find(i);
+		update = (it != oldManifest->mSlices.end()) && isSameFileId(it->second, sliceId);
+	}
 
-		// スライスマップを列挙
-		for (auto& e: mapSlice) {
+	// スライスに入れるファイルごとに、入力の状態と使い回せるかどうかを調べる
+	// 入力ファイルが変わっておらず、前回と同じ位置にあれば、スライスの内容を使い回す
+	struct Input {
+		std::string mInputPath;
+		GasFs::MY_FILEID mId;
+		bool mHasId;
+		const Manifest::Source* mOld;
+		bool mReuse;
+	};
+	std::vector<Input> inputs;
+	std::vector<std::pair<uint64_t, uint64_t>> reuseRanges;
+	{
+		const std::wstring wbasedir = WStrUtil::str2wstr(global.mBaseDir);
+		uint64_t offset = 0;
+		for (const auto& e: mapSlice) {
 			const std::string& path = e.first;
-			GasFs::Entry& entry = e.second;
+			const GasFs::Entry& entry = e.second;
 			if (entry.mSlice != i) {
 				continue;
 			}
+			Input in;
+			in.mInputPath = WStrUtil::wstr2str(WStrUtil::pathAddPath(wbasedir, WStrUtil::str2wstr(path)));
+			in.mId = GasFs::MY_FILEID();
+			in.mHasId = (newManifest != nullptr) && getFileId(in.mInputPath, in.mId);
+			in.mOld = nullptr;
+			in.mReuse = false;
+			if (oldManifest != nullptr) {
+				auto it = oldManifest->mSources.find(path);
+				if (it != oldManifest->mSources.end()) {
+					in.mOld = &(it->second);
+				}
+			}
+			if (update && in.mHasId && (in.mOld != nullptr) && isSameFileId(in.mOld->mId, in.mId) && (in.mId.mSize == entry.mSize)) {
+				auto it = mapOldSlice.find(path);
+				in.mReuse = (it != mapOldSlice.end()) && (it->second.mSlice == i) && (it->second.mOffset == offset)
+				 && (it->second.mSize == entry.mSize) && (it->second.mCRC == in.mOld->mCRC);
+			}
+			if (in.mReuse) {
+				if (!reuseRanges.empty() && (reuseRanges.back().second == offset)) {
+					reuseRanges.back().second += entry.mSize;
+				} else {
+					reuseRanges.push_back(std::make_pair(offset, offset+entry.mSize));
+				}
+			}
+			offset += entry.mSize;
+			inputs.push_back(in);
+		}
+	}
 
-			// 入力を開く
-			const std::wstring wpath = WStrUtil::str2wstr(path);
-			const std::wstring wbasedir = WStrUtil::str2wstr(global.mBaseDir);
-			const std::wstring wpathWithBasedir = WStrUtil::pathAddPath(wbasedir, wpath);
-			const std::string inputPath = WStrUtil::wstr2str(wpathWithBasedir);
-			FILE *fin = nullptr;
-			if (!skip) {
-				fin = fopen(inputPath.c_str(), "rb");
-				if (fin == nullptr) {
-					fprintf(stderr, "Failed: Cannot open input [%s].\n", inputPath.c_str());
-					fclose(fout);
+	// 使い回す内容が前回のチャンクCRCと合わなければ、使い回さずに入力から書き直す
+	if (update && !CheckReuseChunks(slicePath, reuseRanges, global.mSlice[i].mChunkCRC, global.mChecksum)) {
+		printf("treat as rewriting: Slice[%d] data does not match old chunk CRC [%s].\n", i, slicePath);
+		update = false;
+		for (Input& in: inputs) {
+			in.mReuse = false;
+		}
+	}
+
+	// スライスを開く
+	FILE *fout = nullptr;
+	if (!skip) {
+		fout = fopen(slicePath, update ? "r+b" : "wb");
+		if (fout == nullptr) {
+			fprintf(stderr, "Failed: Cannot open slice [%s].\n", slicePath);
+			return false;
+		}
+
+		// サブヘッダの分を書く
+		// その場で更新する場合も、途中で止まったときに作り直されるよう先に消しておく
+		GasFs::Database::SubHeader b = {0};
+		size_t wrotesize = fwrite(&b, 1, sizeof(b), fout);
+		if ((wrotesize != sizeof(b)) || (update && fflush(fout))) {
+			fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
+			fclose(fout);
+			return false;
+		}
+	}
+
+	// チャンクの境界で区切ってCRCを求め、チャンクと(あれば)ファイルの両方につなぐ
+	// XXH3は値をつなげないので、ファイル・チャンク・スライスのそれぞれに流し込む
+	auto sumChunk = [&](const uint8_t* buf, size_t size, uint32_t* filecrc, GasFs::Checksum* fileSum) {
+		size_t pos = 0;
+		while (pos < size) {
+			size_t len = (size_t)std::min((uint64_t)(size-pos), GASFS_CHUNK_SIZE-chunkFill);
+			if (xxh3) {
+				if (fileSum != nullptr) {
+					fileSum->update(buf+pos, len);
+				}
+				chunkSum.update(buf+pos, len);
+				sliceSum.update(buf+pos, len);
+			} else {
+				uint32_t c = GasFs::GetCRC((uint8_t*)buf+pos, (uint32_t)len, 0);
+				if (filecrc != nullptr) {
+					*filecrc = GasFs::CombineCRC(*filecrc, c, len);
+				}
+				chunkcrc = GasFs::CombineCRC(chunkcrc, c, len);
+			}
+			chunkFill += len;
+			pos += len;
+			if (chunkFill == GASFS_CHUNK_SIZE) {
+				chunkCRC.push_back(xxh3 ? (uint32_t)chunkSum.digest() : chunkcrc);
+				chunkcrc = 0;
+				chunkSum.reset();
+				chunkFill = 0;
+			}
+		}
+	};
+
+	// 使い回す範囲のチャンクCRCを求める
+	// CRC32では、範囲に丸ごと含まれるチャンクは前回のチャンクCRCをそのまま使い、
+	// 前後の端数だけをスライスから読む。XXH3では範囲全体をスライスから読む
+	GasFs::CopyPipeline pipeline;
+	uint64_t reuseStart = 0;
+	uint64_t reuseEnd = 0;
+	int reuseFiles = 0;
+	uint64_t reuseSize = 0;
+	auto readReuse = [&](uint64_t offset, uint64_t size) {
+		if (GasFs::my_fseek64(fout, (int64_t)(sizeof(GasFs::Database::SubHeader)+offset))) {
+			fprintf(stderr, "Failed: Cannot read slice [%s].\n", slicePath);
+			return false;
+		}
+		auto reader = [&](uint8_t* buf, size_t size) -> int64_t {
+			size_t readsize = fread(buf, 1, size, fout);
+			if (readsize == 0) {
+				fprintf(stderr, "Failed: Cannot read slice [%s].\n", slicePath);
+				return -1;
+			}
+			return (int64_t)readsize;
+		};
+		auto checksum = [&](const uint8_t* buf, size_t size) {
+			sumChunk(buf, size, nullptr, nullptr);
+			return true;
+		};
+		return (pipeline.run(size, reader, checksum, GasFs::CopyPipeline::Stage()) == (int64_t)size);
+	};
+	auto flushReuse = [&]() {
+		uint64_t pos = reuseStart;
+		if (!xxh3) {
+			const std::vector<uint32_t>& oldChunkCRC = global.mSlice[i].mChunkCRC;
+			if ((chunkFill > 0) && (pos < reuseEnd)) {
+				uint64_t len = std::min(reuseEnd-pos, GASFS_CHUNK_SIZE-chunkFill);
+				if (!readReuse(pos, len)) {
 					return false;
 				}
+				pos += len;
+			}
+			while ((reuseEnd-pos >= GASFS_CHUNK_SIZE) && (pos/GASFS_CHUNK_SIZE < oldChunkCRC.size())) {
+				chunkCRC.push_back(oldChunkCRC[(size_t)(pos/GASFS_CHUNK_SIZE)]);
+				pos += GASFS_CHUNK_SIZE;
 			}
+		}
+		if ((pos < reuseEnd) && !readReuse(pos, reuseEnd-pos)) {
+			return false;
+		}
+		reuseStart = reuseEnd;
+		return true;
+	};
 
-			// スライスのオフセットを記録
-			entry.mOffset = (size_t)totalSize;
-
-			if (!skip) {
-				// bufsizeずつスライスに書き写す
-				uint64_t rest = entry.mSize;
-				const int bufsize = 1024*1024*16;
-				uint8_t* buf = new uint8_t[bufsize];
-				while (rest > 0) {
-					size_t readsize = fread(buf, 1, bufsize, fin);
-					if (readsize == 0) {
-						break;
-					}
-					crc = GasFs::GetCRC(buf, readsize, crc);
-					size_t wrotesize = fwrite(buf, 1, readsize, fout);
-					if (wrotesize != readsize) {
-						fclose(fin);
-						fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
-						return false;
-					}
-					rest -= readsize;
+	// スライスマップを列挙
+	size_t inputIndex = 0;
+	for (auto& e: mapSlice) {
+		const std::string& path = e.first;
+		GasFs::Entry& entry = e.second;
+		if (entry.mSlice != i) {
+			continue;
+		}
+		const Input& in = inputs[inputIndex++];
+		const std::string& inputPath = in.mInputPath;
+		const GasFs::MY_FILEID& id = in.mId;
+		const bool hasId = in.mHasId;
+		const Manifest::Source* old = in.mOld;
+
+		// スライスのオフセットを記録
+		entry.mOffset = (size_t)totalSize;
+
+		// 入力ファイルを記録する
+		// 作り直さないスライスでは、前回の記録を引き継ぐ。記録がなければ今の状態を記録する
+		if (skip) {
+			if (newManifest != nullptr) {
+				std::lock_guard<std::mutex> lock(newManifest->mMutex);
+				if (old != nullptr) {
+					newManifest->mSources[path] = *old;
+				} else if (hasId) {
+					newManifest->mSources[path] = { id, entry.mCRC };
 				}
-				delete[] buf;
-				fclose(fin);
 			}
-
 			totalSize += (int64_t)entry.mSize;
+			continue;
 		}
-		if (!skip) {
-			global.mSlice[i].mTotalSize = (uint64_t)totalSize;
-			global.mSlice[i].mCRC = crc;
+
+		// 使い回すファイルは、まとめて後でチャンクCRCを求める
+		if (in.mReuse) {
+			if (reuseEnd != (uint64_t)totalSize) {
+				reuseStart = (uint64_t)totalSize;
+			}
+			reuseEnd = (uint64_t)totalSize + entry.mSize;
+			reuseFiles++;
+			reuseSize += entry.mSize;
+			entry.mCRC = old->mCRC;
+			if (!xxh3) {
+				crc = GasFs::CombineCRC((uint32_t)crc, entry.mCRC, entry.mSize);
+			}
+			{
+				std::lock_guard<std::mutex> lock(newManifest->mMutex);
+				newManifest->mSources[path] = *old;
+			}
+			totalSize += (int64_t)entry.mSize;
+			continue;
 		}
-		if (gVerbose) {
-			printf("%" PRIi64 "MB\n", totalSize/1024/1024);
+		if (!flushReuse()) {
+			fclose(fout);
+			return false;
 		}
 
-		// スライスサブヘッダを記録
-		if (!skip) {
-			GasFs::Database::SubHeader b = {0};
-
-			struct tm lt = *(gmtime((const time_t*)&(global.mSlice[i].mLastModifiedTime)));
-			char str[16];
-			sprintf(str, "0x%04d%02d", lt.tm_year+1900, lt.tm_mon+1);
-			uint32_t date1 = strtoul(str, nullptr, 0);
-			sprintf(str, "0x%02d%02d%02d%02d", lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
-			uint32_t date2 = strtoul(str, nullptr, 0);
+		// 入力を開く
+		FILE *fin = fopen(inputPath.c_str(), "rb");
+		if (fin == nullptr) {
+			fprintf(stderr, "Failed: Cannot open input [%s].\n", inputPath.c_str());
+			fclose(fout);
+			return false;
+		}
+		if (update && GasFs::my_fseek64(fout, (int64_t)(sizeof(GasFs::Database::SubHeader)+totalSize))) {
+			fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
+			fclose(fin);
+			fclose(fout);
+			return false;
+		}
 
-			size_t files = global.mSlice[i].mFiles;
-			memcpy(&(b.mMark[0]), GASFS_SUBMARK, 4);
-			if (gVerbose) {
-				printf("slice=%d, files=%zu, date=%06x%08x\n", i, files, date1, date2);
+		// 読み込み・CRC計算・書き込みを重ねてスライスに書き写す
+		uint32_t filecrc = 0;
+		GasFs::Checksum fileSum(global.mChecksum);
+		auto reader = [&](uint8_t* buf, size_t size) -> int64_t {
+			size_t readsize = fread(buf, 1, size, fin);
+			if (readsize == 0) {
+				fprintf(stderr, "Failed: Cannot read input [%s].\n", inputPath.c_str());
+				return -1;
 			}
-			b.mSliceNo[0] = i;
-			b.mFiles[0] = (files>>0)&0xff;
-			b.mFiles[1] = (files>>8)&0xff;
-			b.mFiles[2] = (files>>16)&0xff;
-			b.mTotalSize[0] = (totalSize>>0)&0xff;
-			b.mTotalSize[1] = (totalSize>>8)&0xff;
-			b.mTotalSize[2] = (totalSize>>16)&0xff;
-			b.mTotalSize[3] = (totalSize>>24)&0xff;
-			b.mTotalSize[4] = (totalSize>>32)&0xff;
-			b.mTotalSize[5] = (totalSize>>40)&0xff;
-			b.mTotalSize[6] = (totalSize>>48)&0xff;
-			b.mTotalSize[7] = (totalSize>>56)&0xff;
-			b.mCRC[0] = (crc>>0)&0xff;
-			b.mCRC[1] = (crc>>8)&0xff;
-			b.mCRC[2] = (crc>>16)&0xff;
-			b.mCRC[3] = (crc>>24)&0xff;
-			b.mDate[0] = (date1>>16)&0xff;  // 2021/04/07 18:45:01なら"20 21 04 07 18 45 01"のバイト列になる
-			b.mDate[1] = (date1>> 8)&0xff;
-			b.mDate[2] = (date1>> 0)&0xff;
-			b.mDate[3] = (date2>>24)&0xff;
-			b.mDate[4] = (date2>>16)&0xff;
-			b.mDate[5] = (date2>> 8)&0xff;
-			b.mDate[6] = (date2>> 0)&0xff;
-			size_t writeSize = sizeof(b);
-			fseek(fout, 0, SEEK_SET);
-			size_t wroteSize = fwrite(&b, 1, writeSize, fout);
-			if (wroteSize != writeSize) {
+			return (int64_t)readsize;
+		};
+		auto checksum = [&](const uint8_t* buf, size_t size) {
+			sumChunk(buf, size, &filecrc, &fileSum);
+			return true;
+		};
+		auto writer = [&](const uint8_t* buf, size_t size) {
+			size_t wrotesize = fwrite(buf, 1, size, fout);
+			if (wrotesize != size) {
 				fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
-				fclose(fout);
 				return false;
 			}
+			return true;
+		};
+		int64_t copied = pipeline.run(entry.mSize, reader, checksum, writer);
+		fclose(fin);
+		if (copied != (int64_t)entry.mSize) {
+			fclose(fout);
+			return false;
+		}
+
+		// スライスのCRCは、ファイルのCRCをつないで求める
+		// XXH3の場合、ファイルのチェックサムは下位32bitを記録する
+		if (xxh3) {
+			entry.mCRC = (uint32_t)fileSum.digest();
+		} else {
+			entry.mCRC = filecrc;
+			crc = GasFs::CombineCRC((uint32_t)crc, filecrc, entry.mSize);
+		}
+		if (hasId) {
+			std::lock_guard<std::mutex> lock(newManifest->mMutex);
+			newManifest->mSources[path] = { id, entry.mCRC };
+		}
+
+		totalSize += (int64_t)entry.mSize;
+	}
+	if (!skip) {
+		if (!flushReuse()) {
+			fclose(fout);
+			return false;
+		}
+		if (chunkFill > 0) {
+			chunkCRC.push_back(xxh3 ? (uint32_t)chunkSum.digest() : chunkcrc);
+		}
+		if (xxh3) {
+			crc = sliceSum.digest();
+		}
+		global.mSlice[i].mTotalSize = (uint64_t)totalSize;
+		global.mSlice[i].mCRC = crc;
+		global.mSlice[i].mChunkCRC.swap(chunkCRC);
+		if (gVerbose && update) {
+			printf("reuse %d files(%" PRIu64 "MB) ... ", reuseFiles, reuseSize/1024/1024);
+		}
+	}
+	if (gVerbose) {
+		printf("%" PRIi64 "MB\n", totalSize/1024/1024);
+	}
+
+	// スライスサブヘッダを記録
+	if (!skip) {
+		GasFs::Database::SubHeader b = {0};
+
+		struct tm lt;
+		{
+			std::lock_guard<std::mutex> lock(gTimeMutex);
+			lt = *(gmtime((const time_t*)&(global.mSlice[i].mLastModifiedTime)));
+		}
+		char str[16];
+		sprintf(str, "0x%04d%02d", lt.tm_year+1900, lt.tm_mon+1);
+		uint32_t date1 = strtoul(str, nullptr, 0);
+		sprintf(str, "0x%02d%02d%02d%02d", lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
+		uint32_t date2 = strtoul(str, nullptr, 0);
+
+		size_t files = global.mSlice[i].mFiles;
+		memcpy(&(b.mMark[0]), GASFS_SUBMARK, 4);
+		if (gVerbose) {
+			printf("slice=%d, files=%zu, date=%06x%08x\n", i, files, date1, date2);
+		}
+		b.mSliceNo[0] = i;
+		b.mFiles[0] = (files>>0)&0xff;
+		b.mFiles[1] = (files>>8)&0xff;
+		b.mFiles[2] = (files>>16)&0xff;
+		b.mTotalSize[0] = (totalSize>>0)&0xff;
+		b.mTotalSize[1] = (totalSize>>8)&0xff;
+		b.mTotalSize[2] = (totalSize>>16)&0xff;
+		b.mTotalSize[3] = (totalSize>>24)&0xff;
+		b.mTotalSize[4] = (totalSize>>32)&0xff;
+		b.mTotalSize[5] = (totalSize>>40)&0xff;
+		b.mTotalSize[6] = (totalSize>>48)&0xff;
+		b.mTotalSize[7] = (totalSize>>56)&0xff;
+		b.mCRC[0] = (crc>>0)&0xff;
+		b.mCRC[1] = (crc>>8)&0xff;
+		b.mCRC[2] = (crc>>16)&0xff;
+		b.mCRC[3] = (crc>>24)&0xff;
+		b.mCRCHigh[0] = (crc>>32)&0xff;
+		b.mCRCHigh[1] = (crc>>40)&0xff;
+		b.mCRCHigh[2] = (crc>>48)&0xff;
+		b.mCRCHigh[3] = (crc>>56)&0xff;
+		b.mDate[0] = (date1>>16)&0xff;  // 2021/04/07 18:45:01なら"20 21 04 07 18 45 01"のバイト列になる
+		b.mDate[1] = (date1>> 8)&0xff;
+		b.mDate[2] = (date1>> 0)&0xff;
+		b.mDate[3] = (date2>>24)&0xff;
+		b.mDate[4] = (date2>>16)&0xff;
+		b.mDate[5] = (date2>> 8)&0xff;
+		b.mDate[6] = (date2>> 0)&0xff;
+		size_t writeSize = sizeof(b);
+		fseek(fout, 0, SEEK_SET);
+		size_t wroteSize = fwrite(&b, 1, writeSize, fout);
+		if (wroteSize != writeSize) {
+			fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
+			fclose(fout);
+			return false;
 		}
+	}
 
-		// スライスを閉じる
+	// スライスを閉じる
+	// その場で更新して前より短くなったときは、後ろを切り詰める
+	if (!skip) {
+		int err = fclose(fout);
+		const uint64_t sliceSize = sizeof(GasFs::Database::SubHeader) + (uint64_t)totalSize;
+		if (!err && update && (sliceId.mSize > sliceSize)) {
+			err = GasFs::my_truncate(slicePath, sliceSize);
+		}
+		if (err) {
+			fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
+			return false;
+		}
+		int st = _stat(slicePath, &s);
+		if (st == 0) {
+			lastmodifiedtime = s.st_mtime;
+		}
+	}
+
+	// スライスファイルを記録する
+	if (newManifest != nullptr) {
+		GasFs::MY_FILEID id = {0};
+		std::lock_guard<std::mutex> lock(newManifest->mMutex);
 		if (!skip) {
-			int err = fclose(fout);
-			if (err) {
-				fprintf(stderr, "Failed: Cannot write slice [%s].\n", slicePath);
-				return false;
+			if (getFileId(slicePath, id)) {
+				newManifest->mSlices[i] = id;
 			}
-			int st = _stat(slicePath, &s);
-			if (st == 0) {
-				lastmodifiedtime = s.st_mtime;
+		} else if (oldManifest != nullptr) {
+			auto it = oldManifest->mSlices.find(i);
+			if (it != oldManifest->mSlices.end()) {
+				newManifest->mSlices[i] = it->second;
+			} else if (getFileId(slicePath, id)) {
+				newManifest->mSlices[i] = id;
 			}
+		} else if (getFileId(slicePath, id)) {
+			newManifest->mSlices[i] = id;
 		}
-		if (global.mLastModifiedTime < lastmodifiedtime) {
-			global.mLastModifiedTime = lastmodifiedtime;
+	}
+	sliceModifiedTime = lastmodifiedtime;
+	return true;
+}
+
+// =====================================================================
+// スライスマップからスライスファイルを作成する
+// スライスは互いに独立しているので、jobs個のスレッドで並行して作る
+// 同じデバイスに置かれたスライスを同時に書くのはdevJobs個までにする
+// =====================================================================
+
+bool
+MakeSliceFileFromSliceMap(GasFs::Global& global, GasFs::Map& mapSlice, const GasFs::Map& mapOldSlice, const Manifest* oldManifest, Manifest* newManifest, int jobs, int devJobs)
+{
+	int slices = global.mSlices;
+	const std::string& sliceFilename = global.mSliceFilename;
+
+	// スライスの置き場所のデバイスを調べる
+	// スライスファイルがまだなければ、置き場所のディレクトリで調べる
+	std::vector<uint64_t> device(slices+1, 0);
+	{
+		const WStrUtil::pathPair p = WStrUtil::pathSplitPath(WStrUtil::str2wstr(sliceFilename));
+		std::string dir = WStrUtil::wstr2str(p.first);
+		if (dir.empty()) {
+			dir = ".";
+		}
+		struct _stat s;
+		uint64_t dirDevice = (_stat(dir.c_str(), &s) == 0) ? (uint64_t)s.st_dev : 0;
+		for (int i=1; i<=slices; i++) {
+			char slicePath[_MAX_PATH];
+			sprintf(slicePath, "%s_%03d.gfs", sliceFilename.c_str(), i);
+			device[i] = (_stat(slicePath, &s) == 0) ? (uint64_t)s.st_dev : dirDevice;
 		}
 	}
 
-	return true;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<int> pending;
+	for (int i=1; i<=slices; i++) {
+		pending.push_back(i);
+	}
+	std::map<uint64_t, int> busy;
+	bool ok = true;
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (ok && !pending.empty()) {
+			// 空いているデバイスのスライスを番号の若い順に選ぶ
+			auto it = std::find_if(pending.begin(), pending.end(), [&](int i) { return busy[device[i]] < devJobs; });
+			if (it == pending.end()) {
+				cond.wait(lock);
+				continue;
+			}
+			int i = *it;
+			pending.erase(it);
+			busy[device[i]]++;
+			lock.unlock();
+
+			uint64_t lastmodifiedtime = 0;
+			bool ret = MakeSliceFile(global, mapSlice, mapOldSlice, oldManifest, newManifest, i, lastmodifiedtime);
+
+			lock.lock();
+			busy[device[i]]--;
+			if (!ret) {
+				ok = false;
+			}
+			if (global.mLastModifiedTime < lastmodifiedtime) {
+				global.mLastModifiedTime = lastmodifiedtime;
+			}
+			cond.notify_all();
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int k=1; k<std::min(jobs, slices); k++) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (std::thread& t: workers) {
+		t.join();
+	}
+
+	return ok;
 }
 
 // =====================================================================
 // スライスマップからスライスデータベースを作成する
+// rewriteがtrueなら、更新時刻にかかわらず作り直す
 // =====================================================================
 
 bool
-MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map& mapSlice)
+MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map& mapSlice, bool rewrite)
 {
 	int slices = global.mSlices;
 	int maxSliceSize = global.mMaxSliceSize;
 	const std::string& sliceFilename = global.mSliceFilename;
-	uint32_t crc = 0;
+	GasFs::Checksum crc(global.mChecksum);
 	uint64_t totalSize = 0;
 
 	// データベースを開く
@@ -515,7 +1161,7 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 	}
 	struct _stat s;
 	int st = _stat(dbPath, &s);
-	if (st == 0) {
+	if ((st == 0) && !rewrite) {
 		uint64_t lastmodifiedtime = s.st_mtime;
 		if (lastmodifiedtime > global.mLastModifiedTime) {
 			// 全てのスライスの最終更新時刻がデータベースより古かったら更新しない
@@ -555,7 +1201,7 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 
 		size_t files = global.mSlice[i].mFiles;
 		uint64_t slicetotalSize = global.mSlice[i].mTotalSize;
-		uint32_t slicecrc = global.mSlice[i].mCRC;
+		uint64_t slicecrc = global.mSlice[i].mCRC;
 		memcpy(&(b.mMark[0]), GASFS_SUBMARK, 4);
 		if (gVerbose) {
 			printf("slice=%d, files=%zu, date=%06x%08x\n", i, files, date1, date2);
@@ -576,6 +1222,10 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 		b.mCRC[1] = (slicecrc>>8)&0xff;
 		b.mCRC[2] = (slicecrc>>16)&0xff;
 		b.mCRC[3] = (slicecrc>>24)&0xff;
+		b.mCRCHigh[0] = (slicecrc>>32)&0xff;
+		b.mCRCHigh[1] = (slicecrc>>40)&0xff;
+		b.mCRCHigh[2] = (slicecrc>>48)&0xff;
+		b.mCRCHigh[3] = (slicecrc>>56)&0xff;
 		b.mDate[0] = (date1>>16)&0xff;  // 2021/04/07 18:45:01なら"20 21 04 07 18 45 01"のバイト列になる
 		b.mDate[1] = (date1>> 8)&0xff;
 		b.mDate[2] = (date1>> 0)&0xff;
@@ -590,7 +1240,7 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 			fclose(fout);
 			return false;
 		}
-		crc = GasFs::GetCRC((uint8_t*)&b, writeSize, crc);
+		crc.update((const uint8_t*)&b, writeSize);
 		totalSize += writeSize;
 	}
 
@@ -632,7 +1282,7 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 			fclose(fout);
 			return false;
 		}
-		crc = GasFs::GetCRC((uint8_t*)&b, writeSize, crc);
+		crc.update((const uint8_t*)&b, writeSize);
 		totalSize += writeSize;
 	}
 
@@ -645,14 +1295,118 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 			fclose(fout);
 			return false;
 		}
-		crc = GasFs::GetCRC((uint8_t*)pathBuf.data(), writeSize, crc);
+		crc.update((const uint8_t*)pathBuf.data(), writeSize);
+		totalSize += writeSize;
+	}
+
+	// 拡張セクションをデータベースに書き出す
+	// 旧版のリーダーはパス名リストより後ろを読まないので、互換性は保たれる
+	uint8_t flags = 0;
+	uint64_t extOfs = 0;
+	if (global.mChecksum == GasFs::CHECKSUM_XXH3) {
+		flags |= GASFS_FLAG_XXH3;
+	}
+	std::vector<uint8_t> hashIndex;
+	{
+		std::vector<uint64_t> hashes;
+		hashes.reserve(mapSlice.size());
+		for (const auto& e: mapSlice) {
+			const std::string& path = e.first;
+			hashes.push_back(GasFs::GetPathHash(path.c_str(), path.size()));
+		}
+		if (!GasFs::MakeHashIndex(hashes, hashIndex)) {
+			hashIndex.clear();
+			if (gVerbose && !hashes.empty()) {
+				printf("Skip hash index: cannot make hash index.\n");
+			}
+		}
+	}
+	std::vector<uint8_t> fileCRC;
+	fileCRC.reserve(mapSlice.size()*4);
+	for (const auto& e: mapSlice) {
+		const GasFs::Entry& entry = e.second;
+		fileCRC.push_back((entry.mCRC>>0)&0xff);
+		fileCRC.push_back((entry.mCRC>>8)&0xff);
+		fileCRC.push_back((entry.mCRC>>16)&0xff);
+		fileCRC.push_back((entry.mCRC>>24)&0xff);
+	}
+	std::vector<uint8_t> chunkCRC;
+	{
+		const uint32_t chunkSize = GASFS_CHUNK_SIZE;
+		chunkCRC.push_back((chunkSize>>0)&0xff);
+		chunkCRC.push_back((chunkSize>>8)&0xff);
+		chunkCRC.push_back((chunkSize>>16)&0xff);
+		chunkCRC.push_back((chunkSize>>24)&0xff);
+		for (int i=1; i<=slices; i++) {
+			const GasFs::Slice& slice = global.mSlice[i];
+			if (slice.mChunkCRC.size() != (slice.mTotalSize+chunkSize-1)/chunkSize) {
+				if (gVerbose) {
+					printf("Skip chunk CRC: Slice %03d has no chunk CRC.\n", i);
+				}
+				chunkCRC.clear();
+				break;
+			}
+			for (uint32_t c: slice.mChunkCRC) {
+				chunkCRC.push_back((c>>0)&0xff);
+				chunkCRC.push_back((c>>8)&0xff);
+				chunkCRC.push_back((c>>16)&0xff);
+				chunkCRC.push_back((c>>24)&0xff);
+			}
+		}
+	}
+	auto writeExtSection = [&](const char* tag, const std::vector<uint8_t>& section) -> bool {
+		if (!(flags & GASFS_FLAG_EXTENSION)) {
+			flags |= GASFS_FLAG_EXTENSION;
+			extOfs = totalSize;
+		}
+		GasFs::Database::ExtSection b = {0};
+		size_t secSize = section.size();
+		memcpy(&(b.mTag[0]), tag, 4);
+		b.mSize[0] = (secSize>>0)&0xff;
+		b.mSize[1] = (secSize>>8)&0xff;
+		b.mSize[2] = (secSize>>16)&0xff;
+		b.mSize[3] = (secSize>>24)&0xff;
+		size_t writeSize = sizeof(b);
+		size_t wroteSize = fwrite(&b, 1, writeSize, fout);
+		if (wroteSize == writeSize) {
+			crc.update((const uint8_t*)&b, writeSize);
+			totalSize += writeSize;
+			writeSize = secSize;
+			wroteSize = fwrite(section.data(), 1, writeSize, fout);
+		}
+		if (wroteSize != writeSize) {
+			fprintf(stderr, "Failed: Cannot write slice [%s].\n", dbPath);
+			fclose(fout);
+			return false;
+		}
+		crc.update((const uint8_t*)section.data(), writeSize);
 		totalSize += writeSize;
+		return true;
+	};
+	if (!hashIndex.empty()) {
+		if (!writeExtSection(GASFS_EXT_HASHINDEX, hashIndex)) {
+			return false;
+		}
+		if (gVerbose) {
+			printf("hash index: entries=%zu, size=%zu\n", mapSlice.size(), hashIndex.size());
+		}
+	}
+	if (!fileCRC.empty()) {
+		if (!writeExtSection(GASFS_EXT_FILECRC, fileCRC)) {
+			return false;
+		}
+	}
+	if (!chunkCRC.empty()) {
+		if (!writeExtSection(GASFS_EXT_CHUNKCRC, chunkCRC)) {
+			return false;
+		}
 	}
 
 	// データベースヘッダを書き出す
 	fseek(fout, 0, SEEK_SET);
 	{
 		GasFs::Database::Header b = {0};
+		const uint32_t dbcrc = (uint32_t)crc.digest();	// XXH3の場合は下位32bit
 
 		struct tm lt = *(gmtime((const time_t*)&(global.mLastModifiedTime)));
 		char str[16];
@@ -678,10 +1432,10 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 		b.mMaxSliceSize[1] = (maxSliceSize>>8)&0xff;
 		b.mMaxSliceSize[2] = (maxSliceSize>>16)&0xff;
 		b.mMaxSliceSize[3] = (maxSliceSize>>24)&0xff;
-		b.mCRC[0] = (crc>>0)&0xff;
-		b.mCRC[1] = (crc>>8)&0xff;
-		b.mCRC[2] = (crc>>16)&0xff;
-		b.mCRC[3] = (crc>>24)&0xff;
+		b.mCRC[0] = (dbcrc>>0)&0xff;
+		b.mCRC[1] = (dbcrc>>8)&0xff;
+		b.mCRC[2] = (dbcrc>>16)&0xff;
+		b.mCRC[3] = (dbcrc>>24)&0xff;
 		b.mDate[0] = (date1>>16)&0xff;  // 2021/04/07 18:45:01なら"20 21 04 07 18 45 01"のバイト列になる
 		b.mDate[1] = (date1>> 8)&0xff;
 		b.mDate[2] = (date1>> 0)&0xff;
@@ -689,6 +1443,11 @@ MakeSliceDatabaseFileFromSliceMap(const GasFs::Global& global, const GasFs::Map&
 		b.mDate[4] = (date2>>16)&0xff;
 		b.mDate[5] = (date2>> 8)&0xff;
 		b.mDate[6] = (date2>> 0)&0xff;
+		b.mFlags[0] = flags;
+		b.mExtOfs[0] = (extOfs>>0)&0xff;
+		b.mExtOfs[1] = (extOfs>>8)&0xff;
+		b.mExtOfs[2] = (extOfs>>16)&0xff;
+		b.mExtOfs[3] = (extOfs>>24)&0xff;
 		size_t writeSize = sizeof(b);
 		size_t wroteSize = fwrite(&b, 1, writeSize, fout);
 		if (wroteSize != writeSize) {
@@ -729,6 +1488,9 @@ exportMapList(const GasFs::Global& global, const std::string& outputFilename, co
 	fprintf(fout, "[Global]\n");
 	fprintf(fout, "Slices=%d\n", global.mSlices);
 	fprintf(fout, "MaxSliceSize=%d\n", global.mMaxSliceSize);
+	if (global.mChecksum == GasFs::CHECKSUM_XXH3) {
+		fprintf(fout, "Checksum=XXH3\n");
+	}
 	fprintf(fout, "\n");
 
 	fprintf(fout, "[Input]\n");
@@ -771,11 +1533,14 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	bool ret;
 	bool list = false;
 	std::string listFilename;
+	std::string manifestFilename;
 	std::string inputFilename;
 	std::string outputFilename;
 	std::string basedir;
 	std::wstring winputFilename;
 	std::wstring wbasedir;
+	int jobs = 1;
+	int devJobs = 0;
 
 	// ロケール設定
 #if defined(_WINDOWS)
@@ -829,10 +1594,39 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 			list = true;
 			continue;
 		}
+		if (arg == "--manifest") {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify --manifest param.\n");
+				exit(EXIT_FAILURE);
+			}
+			std::wstring wfilename(argv[i+1]);
+			wfilename = WStrUtil::pathBackslash2Slash(wfilename);
+			manifestFilename = WStrUtil::wstr2str(wfilename);
+			i++;
+			continue;
+		}
 		if (arg == "--verbose") {
 			gVerbose = true;
 			continue;
 		}
+		if ((arg == "--jobs") || (arg == "--devjobs")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify %s param.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			int n = atoi(WStrUtil::wstr2str(argv[i+1]).c_str());
+			if (n < 1) {
+				fprintf(stderr, "Failed: %s param > 0.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (arg == "--jobs") {
+				jobs = n;
+			} else {
+				devJobs = n;
+			}
+			i++;
+			continue;
+		}
 		if (arg == "--force") {
 			global.mForce = true;
 			continue;
@@ -892,13 +1686,25 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	}
 	int slices = inputGFI.getInt("Global", "Slices");
 	int maxSliceSize = inputGFI.getInt("Global", "MaxSliceSize");
+	GasFs::ChecksumType checksum = GasFs::CHECKSUM_CRC32;
+	{
+		const std::string& name = inputGFI.getString("Global", "Checksum");
+		if (name == "XXH3") {
+			checksum = GasFs::CHECKSUM_XXH3;
+		} else if (!name.empty() && (name != "CRC32")) {
+			fprintf(stderr, "Failed: Unknown Checksum [%s] in [%s].\n", name.c_str(), inputPath.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	// すでにスライスデータベースが存在していれば読む
-	// 構造が異なる場合は--forceが付いているものとして扱う
+	// スライスの数や最大サイズが変わっても、収録するファイルが同じスライスは作り直さない
+	// 引き継げない情報がある場合は--forceが付いているものとして扱う
 	global.mSliceFilename = outputFilename;
 	char dbPath[_MAX_PATH];
 	sprintf(dbPath, "%s_000.gfs", global.mSliceFilename.c_str());
 	GasFs::Map mapOldSlice;
+	bool rewriteDatabase = false;
 	FILE* fin = fopen(dbPath, "rb");
 	if (fin) {
 		GasFs::Database::Header b = {0};
@@ -908,17 +1714,30 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 			int ret = GasFs::createMap(global, mapOldSlice);
 			if (ret >= 0) {
 				do {
-					if (global.mSlices != slices) {
-						printf("treat as --force option: old Slice database [%s] slices(%d) is not equal to new slices(%d).\n", dbPath, global.mSlices, slices);
+					if (!global.mHasFileCRC) {
+						printf("treat as --force option: old Slice database [%s] has no file CRC.\n", dbPath);
 						global.mForce = true;
 						break;
 					}
-					if (global.mMaxSliceSize != maxSliceSize) {
-						printf("treat as --force option: old Slice database [%s] max slice size(%d) is not equal to new max slice size(%d).\n", dbPath, global.mMaxSliceSize, maxSliceSize);
+					if (global.mChunkSize != GASFS_CHUNK_SIZE) {
+						printf("treat as --force option: old Slice database [%s] chunk size(%u) is not equal to %u.\n", dbPath, global.mChunkSize, (uint32_t)GASFS_CHUNK_SIZE);
+						global.mForce = true;
+						break;
+					}
+					if (global.mChecksum != checksum) {
+						printf("treat as --force option: old Slice database [%s] checksum type is different.\n", dbPath);
 						global.mForce = true;
 						break;
 					}
 				} while (0);
+
+				// スライスを作り直さなくても、データベースのヘッダが変わるなら作り直す
+				if ((global.mSlices != slices) || (global.mMaxSliceSize != maxSliceSize)) {
+					if (gVerbose) {
+						printf("rewrite Slice database: old Slice database [%s] slices(%d) / max slice size(%d) is not equal to new slices(%d) / max slice size(%d).\n", dbPath, global.mSlices, global.mMaxSliceSize, slices, maxSliceSize);
+					}
+					rewriteDatabase = true;
+				}
 			}
 		}
 	}
@@ -926,10 +1745,12 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	// グローバル情報を更新
 	global.mSlices = slices;
 	global.mMaxSliceSize = maxSliceSize;
+	global.mChecksum = checksum;
 	global.mLastModifiedTime = 0;
 	global.mSlice.resize(slices+1);
 
-	// GFIファイルが新しい場合は--forceが付いているものとして扱う
+	// GFIファイルがデータベースより新しい場合はデータベースを作り直す
+	// スライスは、収録するファイルが変わったものだけを作り直す
 	{
 		uint64_t lmdInput = 0;
 		uint64_t lmdOutput = 0;
@@ -943,9 +1764,9 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 			lmdOutput = s.st_mtime;
 		}
 		if (lmdInput > lmdOutput) {
-			global.mForce = true;
+			rewriteDatabase = true;
 			if (gVerbose) {
-				printf("treat as --force option: Slice file [%s] time(%" PRIu64 ") < GFI file time(%" PRIu64 ")\n", dbPath, lmdOutput, lmdInput);
+				printf("rewrite Slice database: Slice file [%s] time(%" PRIu64 ") < GFI file time(%" PRIu64 ")\n", dbPath, lmdOutput, lmdInput);
 			}
 		}
 	}
@@ -999,64 +1820,38 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	if (gVerbose) {
 		printf("\n* Fill SliceMap\n");
 	}
-	ret = FillSliceMapInfoFromInputPathMap(global, mapSlice, mapInputPath);
+	ret = FillSliceMapInfoFromInputPathMap(global, mapSlice, mapInputPath, mapOldSlice);
 	if (!ret) {
 		exit(EXIT_FAILURE);
 	}
 
-	// 現在のスライスデータベースと内容が食い違う場合は--forceが付いているものとして扱う
+	// 現在のスライスデータベースと内容が食い違うスライスだけを作り直す
 	if (!global.mForce) {
 		if (gVerbose) {
 			printf("\n* Compare SliceMap\n");
 		}
-		do {
-			if (mapSlice.size() != mapOldSlice.size()) {
-				global.mForce = true;
-				if (gVerbose) {
-					printf("treat as --force option: old Slice file [%s] files(%d) != new Slice files(%d)\n", dbPath, mapOldSlice.size(), mapSlice.size());
-				}
-				break;
-			}
-			GasFs::Map::iterator it1 = mapSlice.begin();
-			GasFs::Map::iterator it2 = mapOldSlice.begin();
-			while (!0) {
-				if ((it1 == mapSlice.end()) || (it2 == mapOldSlice.end())) {
-					break;
-				}
-				const std::string& path1 = it1->first;
-				const GasFs::Entry& entry1 = it1->second;
-				const std::string& path2 = it2->first;
-				const GasFs::Entry& entry2 = it2->second;
-				if (path1 != path2) {
-					global.mForce = true;
-					if (gVerbose) {
-						printf("treat as --force option: different entry: old File [%s], new File [%s]\n", path1.c_str(), path2.c_str());
-					}
-					break;
-				}
-				if (entry1.mSlice != entry2.mSlice) {
-					global.mForce = true;
-					if (gVerbose) {
-						printf("treat as --force option: old File [%s] Slice(%d) != new File [%s] Slice(%d)\n", path2.c_str(), entry2.mSlice, path1.c_str(), entry1.mSlice);
-					}
-					break;
-				}
-				it1++;
-				it2++;
-			}
-			if (!global.mForce) {
-				if (gVerbose) {
-					printf("all old Slice file [%s] files(%d) == new Slice files(%d)\n", dbPath, mapOldSlice.size(), mapSlice.size());
-				}
-			}
-		} while (0);
+		int dirty = MarkDirtySlices(global, mapSlice, mapOldSlice);
+		if (gVerbose) {
+			printf("%d of %d slices have different files from old Slice database [%s]\n", dirty, slices, dbPath);
+		}
+		if (dirty > 0) {
+			rewriteDatabase = true;
+		}
+	} else {
+		rewriteDatabase = true;
 	}
 
 	// スライスマップからスライスファイルを作る
 	if (gVerbose) {
 		printf("\n* Make Slice File\n");
 	}
-	ret = MakeSliceFileFromSliceMap(global, mapSlice);
+	Manifest oldManifest;
+	Manifest newManifest;
+	const bool manifest = !manifestFilename.empty();
+	if (manifest) {
+		loadManifest(manifestFilename, oldManifest);
+	}
+	ret = MakeSliceFileFromSliceMap(global, mapSlice, mapOldSlice, manifest ? &oldManifest : nullptr, manifest ? &newManifest : nullptr, jobs, (devJobs > 0) ? devJobs : jobs);
 	if (!ret) {
 		exit(EXIT_FAILURE);
 	}
@@ -1065,11 +1860,22 @@ wmain(int argc, wchar_t** argv, wchar_t** envp)
 	if (gVerbose) {
 		printf("\n* Make Slice Database\n");
 	}
-	ret = MakeSliceDatabaseFileFromSliceMap(global, mapSlice);
+	ret = MakeSliceDatabaseFileFromSliceMap(global, mapSlice, rewriteDatabase);
 	if (!ret) {
 		exit(EXIT_FAILURE);
 	}
 
+	// 入力ファイルを記録
+	if (manifest) {
+		if (gVerbose) {
+			printf("\n* Save Manifest to [%s]\n", manifestFilename.c_str());
+		}
+		ret = saveManifest(manifestFilename, newManifest);
+		if (!ret) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	// スライスリストをエクスポート
 	if (list) {
 		if (gVerbose) {
@@ -0,0 +1,545 @@
+﻿// ◇
+// gasfs: GORRY's archive and slice file system
+// ScrubGasFs: gasfsファイルの定期確認
+// Copyright: (C)2021 Hiroaki GOTO as GORRY.
+// License: see readme.txt
+// =====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <wchar.h>
+#include <time.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#include "WStrUtil.h"
+#include "GasFs.h"
+
+// -------------------------------------------------------------
+
+bool gVerbose;
+
+
+// =====================================================================
+// ヘルプ表示
+// =====================================================================
+
+void showHelp()
+{
+	printf("%s", 
+	   "ScrubGasFs: GORRY's Archive and Slice File System: Version " GASFS_VERSION " GORRY.\n"
+	   "Usage:\n"
+	   "  scrubgasfs [input_000.gfs|dir] ...\n"
+	   "                        Verify slices of [input_000.gfs] and all *_000.gfs under [dir]\n"
+	   "                        in the background.\n"
+	   "Option:\n"
+	   "  --bps [bytes]         Limit read bytes per second (K/M/G suffix, 0: no limit).\n"
+	   "                        Default is 32M.\n"
+	   "  --iops [num]          Limit read operations per second (0: no limit).\n"
+	   "                        Default is 100.\n"
+	   "  --readsize [bytes]    Read size of slices without chunk CRC (K/M suffix).\n"
+	   "                        Default is 1M.\n"
+	   "  --state [file]        Save progress to [file] and resume from it.\n"
+	   "                        Default is scrubgasfs.state.\n"
+	   "  --time [sec]          Stop after [sec] seconds and save progress.\n"
+	   "  --loop                Repeat verification until stopped.\n"
+	   "  --interval [sec]      Wait [sec] seconds between passes of --loop.\n"
+	   "                        Default is 3600.\n"
+	   "  --verbose             Output verbose log.\n"
+	   "  --help                Show this.\n"
+	);
+}
+
+// =====================================================================
+// "32M"のような数値を読む
+// =====================================================================
+
+bool
+parseSize(const std::string& str, uint64_t& value)
+{
+	char* end = nullptr;
+	uint64_t v = strtoull(str.c_str(), &end, 10);
+	if (end == str.c_str()) {
+		return false;
+	}
+	switch (toupper(*end)) {
+	  case 'G':
+		v *= 1024;
+		// FALLTHROUGH
+	  case 'M':
+		v *= 1024;
+		// FALLTHROUGH
+	  case 'K':
+		v *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\0') {
+		return false;
+	}
+	value = v;
+	return true;
+}
+
+// =====================================================================
+// 読み込みの速度制限
+// 読み込みごとに、バイト数と回数の両方の上限を守るだけの間隔を空ける
+// 休んでいた分をまとめて使うことはしない(まとめて読むと他の読み込みが待たされる)
+// =====================================================================
+
+class Throttle
+{
+public:		// function
+	Throttle(uint64_t bytesPerSec, uint64_t iops)
+	 : mBytesPerSec((double)bytesPerSec)
+	 , mIops((double)iops)
+	 , mNext(std::chrono::steady_clock::now())
+	{
+	}
+
+	void wait(size_t len)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (mNext < now) {
+			mNext = now;
+		} else {
+			std::this_thread::sleep_until(mNext);
+		}
+		double sec = 0;
+		if (mBytesPerSec > 0) {
+			sec = std::max(sec, (double)len / mBytesPerSec);
+		}
+		if (mIops > 0) {
+			sec = std::max(sec, 1.0 / mIops);
+		}
+		mNext += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(sec));
+	}
+
+private:	// var
+	double mBytesPerSec;
+	double mIops;
+	std::chrono::steady_clock::time_point mNext;
+};
+
+// =====================================================================
+// 進捗の記録
+// 1行に1つのデータベースについて、
+// 「最後に確認を終えた時刻 次のスライス 次の位置 そのスライスのCRC エラー数 パス名」を記録する
+// =====================================================================
+
+struct Progress {
+	int64_t mLastDone;	// 最後に全スライスの確認を終えた時刻(0なら未確認)
+	int mSlice;			// 確認中のスライス(0なら次は先頭から)
+	uint64_t mOffset;	// 確認中のスライスの次に読む位置
+	uint64_t mCRC;		// 確認中のスライスのCRC(スライスが作り直されたら最初から読む)
+	int mErrors;		// 最後の確認で見つかったエラーの数
+};
+
+typedef std::map<std::string, Progress> ProgressMap;
+
+bool
+loadProgress(const std::string& filename, ProgressMap& progressMap)
+{
+	FILE* fin = fopen(filename.c_str(), "r");
+	if (fin == nullptr) {
+		// まだ記録がない
+		return true;
+	}
+	char line[_MAX_PATH+256];
+	while (fgets(line, sizeof(line), fin) != nullptr) {
+		Progress progress = {0};
+		int pathofs = 0;
+		int n = sscanf(line, "%" SCNd64 " %d %" SCNu64 " %" SCNx64 " %d %n", &progress.mLastDone, &progress.mSlice, &progress.mOffset, &progress.mCRC, &progress.mErrors, &pathofs);
+		if ((n != 5) || (pathofs == 0)) {
+			continue;
+		}
+		std::string path(line+pathofs);
+		while (!path.empty() && ((path.back() == '\n') || (path.back() == '\r'))) {
+			path.pop_back();
+		}
+		if (!path.empty()) {
+			progressMap[path] = progress;
+		}
+	}
+	fclose(fin);
+	return true;
+}
+
+bool
+saveProgress(const std::string& filename, const ProgressMap& progressMap)
+{
+	// 書きかけのファイルを残さないよう、別名で書いてから置き換える
+	std::string tmpname = filename + ".tmp" + std::to_string(GasFs::my_getpid());
+	FILE* fout = fopen(tmpname.c_str(), "w");
+	if (fout == nullptr) {
+		fprintf(stderr, "Failed: Cannot write [%s].\n", tmpname.c_str());
+		return false;
+	}
+	bool ok = true;
+	for (const auto& e: progressMap) {
+		const Progress& progress = e.second;
+		if (fprintf(fout, "%" PRId64 " %d %" PRIu64 " %016" PRIx64 " %d %s\n", progress.mLastDone, progress.mSlice, progress.mOffset, progress.mCRC, progress.mErrors, e.first.c_str()) < 0) {
+			ok = false;
+		}
+	}
+	if (fclose(fout)) {
+		ok = false;
+	}
+	if (!ok || GasFs::my_rename(tmpname.c_str(), filename.c_str())) {
+		fprintf(stderr, "Failed: Cannot write [%s].\n", filename.c_str());
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
+
+// =====================================================================
+// 確認するデータベースを集める
+// ディレクトリが指定されたら、その下の"_000.gfs"をすべて探す
+// =====================================================================
+
+bool
+isDatabaseName(const std::string& path)
+{
+	return (path.size() > 8) && (path.compare(path.size()-8, 8, "_000.gfs") == 0);
+}
+
+bool
+findDatabases(const std::string& path, std::vector<std::string>& databases)
+{
+	if (isDatabaseName(path)) {
+		databases.push_back(path);
+		return true;
+	}
+	DIR* dirp = opendir(path.c_str());
+	if (dirp == nullptr) {
+		fprintf(stderr, "Failed: Folder not found [%s].\n", path.c_str());
+		return false;
+	}
+	const std::wstring wpath = WStrUtil::pathAddSlash(WStrUtil::str2wstr(path));
+	struct dirent* ent;
+	while ((ent = readdir(dirp)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+		const std::wstring wname = WStrUtil::str2wstr(std::string(ent->d_name));
+		const std::string newpath = WStrUtil::wstr2str(WStrUtil::pathAddPath(wpath, wname));
+		if (ent->d_type & DT_DIR) {
+			findDatabases(newpath, databases);
+			continue;
+		}
+		if ((ent->d_type & DT_REG) && isDatabaseName(newpath)) {
+			databases.push_back(newpath);
+		}
+	}
+	closedir(dirp);
+	return true;
+}
+
+// =====================================================================
+// データベース1つ分のスライスを確認する
+// チャンクごとのCRCがあればチャンク単位で確認し、途中から再開できるようにする
+// なければスライス単位で確認し、中断したらそのスライスを最初から読み直す
+// 戻り値は、最後まで確認したらtrue、時間切れで中断したらfalse
+// =====================================================================
+
+struct ScrubContext {
+	Throttle* mThrottle;
+	uint64_t mReadSize;
+	std::chrono::steady_clock::time_point mDeadline;	// time_point::max()なら無制限
+	std::function<void()> mSave;	// 進捗を記録する
+	uint64_t mBytes;
+	int mErrors;
+};
+
+bool
+scrubDatabase(const std::string& dbPath, Progress& progress, ScrubContext& ctx)
+{
+	// データベースとスライスのサブヘッダ・サイズを確認する
+	GasFs::Global global = {0};
+	global.mSliceFilename = dbPath.substr(0, dbPath.size()-8);
+	GasFs::Map map;
+	int slices = GasFs::createMap(global, map);
+	if (slices < 0) {
+		fprintf(stderr, "Failed: Scrub [%s] database error.\n", dbPath.c_str());
+		ctx.mErrors++;
+		progress.mErrors++;
+		progress.mSlice = 0;
+		progress.mOffset = 0;
+		progress.mLastDone = (int64_t)time(nullptr);
+		return true;
+	}
+	if ((progress.mSlice < 1) || (progress.mSlice > slices)) {
+		progress.mSlice = 1;
+		progress.mOffset = 0;
+		progress.mErrors = 0;
+	}
+
+	std::vector<uint8_t> buf;
+	auto lastSave = std::chrono::steady_clock::now();
+	for (int i=progress.mSlice; i<=slices; i++) {
+		const GasFs::Slice& slice = global.mSlice[i];
+		const uint64_t totalSize = slice.mTotalSize;
+		const uint64_t chunkSize = global.mChunkSize;
+		const bool useChunks = (chunkSize > 0) && (slice.mChunkCRC.size() == (totalSize+chunkSize-1)/chunkSize);
+		const uint64_t readSize = useChunks ? chunkSize : ctx.mReadSize;
+		if ((progress.mSlice != i) || (progress.mCRC != slice.mCRC) || !useChunks || (progress.mOffset % readSize)) {
+			progress.mOffset = 0;
+		}
+		progress.mSlice = i;
+		progress.mCRC = slice.mCRC;
+		if (gVerbose) {
+			printf("Scrub [%s] Slice[%d] from %" PRIu64 "MB\n", dbPath.c_str(), i, progress.mOffset/1024/1024);
+		}
+
+		char slicePath[_MAX_PATH];
+		sprintf(slicePath, "%s_%03d.gfs", global.mSliceFilename.c_str(), i);
+		GasFs::MY_FD fd = GasFs::my_open(slicePath);
+		if (fd < 0) {
+			fprintf(stderr, "Failed: Cannot open [%s].\n", slicePath);
+			ctx.mErrors++;
+			progress.mErrors++;
+			progress.mOffset = 0;
+			continue;
+		}
+		buf.resize((size_t)readSize);
+		GasFs::Checksum sum(global.mChecksum);
+		uint64_t pos = progress.mOffset;
+		bool failed = false;
+		while (pos < totalSize) {
+			if (std::chrono::steady_clock::now() >= ctx.mDeadline) {
+				GasFs::my_close(fd);
+				progress.mOffset = useChunks ? pos : 0;
+				return false;
+			}
+			const size_t len = (size_t)std::min(readSize, totalSize-pos);
+			const uint64_t filepos = pos+sizeof(GasFs::Database::SubHeader);
+			ctx.mThrottle->wait(len);
+			int64_t readsize = GasFs::my_pread(fd, buf.data(), len, filepos);
+			if (readsize != (int64_t)len) {
+				fprintf(stderr, "Failed: Cannot read [%s].\n", slicePath);
+				failed = true;
+				break;
+			}
+			if (useChunks) {
+				const uint64_t k = pos/chunkSize;
+				uint32_t datacrc = (uint32_t)GasFs::GetChecksum(global.mChecksum, buf.data(), len);
+				if (datacrc != slice.mChunkCRC[(size_t)k]) {
+					fprintf(stderr, "Failed: Slice[%d] chunk %" PRIu64 " CRC error(header=%08x, data=%08x) [%s].\n", i, k, slice.mChunkCRC[(size_t)k], datacrc, slicePath);
+					ctx.mErrors++;
+					progress.mErrors++;
+				}
+			} else {
+				sum.update(buf.data(), len);
+			}
+			// 確認のための読み込みでページキャッシュを汚さない
+			GasFs::my_dropcache(fd, filepos, len);
+			pos += len;
+			ctx.mBytes += len;
+			progress.mOffset = useChunks ? pos : 0;
+
+			// 長いスライスでは、ときどき進捗を記録する
+			auto now = std::chrono::steady_clock::now();
+			if (useChunks && (now-lastSave >= std::chrono::seconds(30))) {
+				ctx.mSave();
+				lastSave = now;
+			}
+		}
+		GasFs::my_close(fd);
+		if (failed) {
+			ctx.mErrors++;
+			progress.mErrors++;
+		} else if (!useChunks && (sum.digest() != slice.mCRC)) {
+			fprintf(stderr, "Failed: Slice[%d] CRC error(header=%08" PRIx64 ", data=%08" PRIx64 ") [%s].\n", i, slice.mCRC, sum.digest(), slicePath);
+			ctx.mErrors++;
+			progress.mErrors++;
+		}
+		progress.mOffset = 0;
+		if (i < slices) {
+			progress.mSlice = i+1;
+			ctx.mSave();
+			lastSave = std::chrono::steady_clock::now();
+		}
+	}
+
+	progress.mSlice = 0;
+	progress.mOffset = 0;
+	progress.mCRC = 0;
+	progress.mLastDone = (int64_t)time(nullptr);
+	return true;
+}
+
+// =====================================================================
+// メイン
+// =====================================================================
+
+int
+wmain(int argc, wchar_t** argv, wchar_t** envp)
+{
+	uint64_t bytesPerSec = 32*1024*1024;
+	uint64_t iops = 100;
+	uint64_t readSize = 1024*1024;
+	uint64_t timeLimit = 0;
+	uint64_t interval = 3600;
+	bool loop = false;
+	std::string stateFilename("scrubgasfs.state");
+	std::vector<std::string> inputs;
+
+	// ロケール設定
+#if defined(_WINDOWS)
+	const char* env = getenv("LANG");
+	if ((env == nullptr) || (env[0] == '\0')) {
+		env = ".utf8";
+	}
+	env = setlocale(LC_ALL, env);
+#endif
+
+	for (int i=1; i<argc; i++) {
+		std::wstring warg(argv[i]);
+		std::string arg = WStrUtil::wstr2str(warg);
+		if (arg == "--help") {
+			showHelp();
+			return 0;
+		}
+		if ((arg == "--bps") || (arg == "--iops") || (arg == "--readsize") || (arg == "--time") || (arg == "--interval")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify %s param.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			uint64_t value = 0;
+			if (!parseSize(WStrUtil::wstr2str(argv[i+1]), value)) {
+				fprintf(stderr, "Failed: Invalid %s param.\n", arg.c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (arg == "--bps") {
+				bytesPerSec = value;
+			} else if (arg == "--iops") {
+				iops = value;
+			} else if (arg == "--readsize") {
+				if (value < 4096) {
+					fprintf(stderr, "Failed: --readsize param >= 4096.\n");
+					exit(EXIT_FAILURE);
+				}
+				readSize = value;
+			} else if (arg == "--time") {
+				timeLimit = value;
+			} else {
+				interval = value;
+			}
+			i++;
+			continue;
+		}
+		if (arg == "--state") {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Failed: Specify --state param.\n");
+				exit(EXIT_FAILURE);
+			}
+			std::wstring wfilename(argv[i+1]);
+			wfilename = WStrUtil::pathBackslash2Slash(wfilename);
+			stateFilename = WStrUtil::wstr2str(wfilename);
+			i++;
+			continue;
+		}
+		if (arg == "--loop") {
+			loop = true;
+			continue;
+		}
+		if (arg == "--verbose") {
+			gVerbose = true;
+			continue;
+		}
+		inputs.push_back(WStrUtil::wstr2str(WStrUtil::pathBackslash2Slash(warg)));
+	}
+
+	// 入力がなければ終了
+	if (inputs.empty()) {
+		fprintf(stderr, "Failed: Specify [input_000.gfs] or [dir].\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// 他の読み込みの邪魔をしないよう、I/Oの優先度を下げる
+	if (GasFs::my_setidleio() && gVerbose) {
+		printf("Cannot set idle I/O priority.\n");
+	}
+
+	ProgressMap progressMap;
+	loadProgress(stateFilename, progressMap);
+
+	Throttle throttle(bytesPerSec, iops);
+	ScrubContext ctx;
+	ctx.mThrottle = &throttle;
+	ctx.mReadSize = readSize;
+	ctx.mDeadline = std::chrono::steady_clock::time_point::max();
+	if (timeLimit > 0) {
+		ctx.mDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeLimit);
+	}
+	ctx.mSave = [&]() { saveProgress(stateFilename, progressMap); };
+	ctx.mBytes = 0;
+	ctx.mErrors = 0;
+
+	bool timeout = false;
+	while (!timeout) {
+		// 入力を毎回探し直して、増えたアーカイブも対象にする
+		std::vector<std::string> databases;
+		for (const std::string& input: inputs) {
+			findDatabases(input, databases);
+		}
+		std::sort(databases.begin(), databases.end());
+		databases.erase(std::unique(databases.begin(), databases.end()), databases.end());
+
+		// 確認途中のもの、確認してから長く経ったものから順に確認する
+		for (const std::string& dbPath: databases) {
+			progressMap.insert(std::make_pair(dbPath, Progress()));
+		}
+		std::stable_sort(databases.begin(), databases.end(), [&](const std::string& a, const std::string& b) {
+			const Progress& pa = progressMap.at(a);
+			const Progress& pb = progressMap.at(b);
+			if ((pa.mSlice > 0) != (pb.mSlice > 0)) {
+				return pa.mSlice > 0;
+			}
+			return pa.mLastDone < pb.mLastDone;
+		});
+
+		for (const std::string& dbPath: databases) {
+			Progress& progress = progressMap[dbPath];
+			auto t0 = std::chrono::steady_clock::now();
+			uint64_t bytes0 = ctx.mBytes;
+			bool done = scrubDatabase(dbPath, progress, ctx);
+			ctx.mSave();
+			double sec = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+			uint64_t bytes = ctx.mBytes-bytes0;
+			if (!done) {
+				printf("Scrub [%s] suspended at Slice[%d], %" PRIu64 "MB in %.1fs.\n", dbPath.c_str(), progress.mSlice, bytes/1024/1024, sec);
+				timeout = true;
+				break;
+			}
+			printf("Scrub [%s] %s, %d errors, %" PRIu64 "MB in %.1fs.\n", dbPath.c_str(), progress.mErrors ? "NG" : "OK", progress.mErrors, bytes/1024/1024, sec);
+		}
+		if (timeout || !loop) {
+			break;
+		}
+
+		// 次の周回まで待つ
+		auto next = std::chrono::steady_clock::now() + std::chrono::seconds(interval);
+		if (next >= ctx.mDeadline) {
+			break;
+		}
+		std::this_thread::sleep_until(next);
+	}
+
+	if (ctx.mErrors) {
+		fprintf(stderr, "Failed: Scrub found %d errors.\n", ctx.mErrors);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+// =====================================================================
+// [EOF]
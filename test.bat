@@ -4,5 +4,13 @@ Release\MkGasFs.exe test.gfi --output testout\testout --basedir test --list test
 Release\MkGasFs.exe test.gfi --output testout\testout --basedir test --list testout.gfi --verbose
 mkdir testext
 Release\ExGasFs.exe testout\testout_000.gfs --extract testext --list testext.gfi --verbose
+Release\ExGasFs.exe testout\testout_000.gfs --verify --verifycache testout\verify.txt
+Release\ExGasFs.exe testout\testout_000.gfs --verify --verifycache testout\verify.txt --verbose
+Release\MkGasFs.exe test_xxh3.gfi --output testout\testxxh3 --basedir test --manifest testout\testxxh3.txt --jobs 2 --verbose --force
+Release\MkGasFs.exe test_xxh3.gfi --output testout\testxxh3 --basedir test --manifest testout\testxxh3.txt --jobs 2 --verbose
+mkdir testext_xxh3
+Release\ExGasFs.exe testout\testxxh3_000.gfs --extract testext_xxh3 --verbose
+Release\ExGasFs.exe testout\testxxh3_000.gfs --verify --jobs 2
+Release\CrcBench.exe --nobench
 
 